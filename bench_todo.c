@@ -0,0 +1,755 @@
+#include <ctype.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "todo.h"
+
+/*
+ * Benchmarks for the todo file handling. Run all of them with:
+ *
+ *   zig run bench_todo.c todo.c -DTESTING -O ReleaseFast
+ *
+ * or pass the name of a single benchmark as the first argument.
+ */
+
+#define BENCH_FILENAME "bench_todo.md"
+
+/**
+ * Seconds since some fixed point, for timing.
+ */
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Write a synthetic todo file with num_lines lines. Every finished_every-th
+ * task is finished, and every tenth line carries a long URL so that it
+ * exceeds the old 256 byte line limit.
+ *
+ * @return The size of the file in bytes.
+ */
+static size_t write_bench_file(const char *filename, int num_lines, int finished_every) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < num_lines; i++) {
+        if (i % 50 == 0) {
+            fprintf(file, "\n## Section %d\n", i / 50);
+        }
+        fprintf(file, "- [%c] task number %d", (finished_every && i % finished_every == 0) ? 'x' : ' ', i);
+        if (i % 10 == 0) {
+            fprintf(file, " see https://example.com/logs/");
+            for (int j = 0; j < 40; j++) {
+                fprintf(file, "%08x", (unsigned)(i * 31 + j));
+            }
+        }
+        fprintf(file, "\n");
+    }
+
+    size_t size = (size_t)ftell(file);
+    fclose(file);
+    return size;
+}
+
+/**
+ * The fgets based reader get_all_lines() used to be, kept as a baseline. Its
+ * allocations are added to todo_alloc_count like todo.c's own.
+ */
+static char **fgets_read_lines(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        return NULL;
+    }
+
+    char line[256];
+    char **lines = NULL;
+    int num_lines = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        num_lines++;
+        lines = realloc(lines, num_lines * sizeof(char *));
+        lines[num_lines - 1] = strdup(line);
+        todo_alloc_count += 2;
+    }
+    fclose(file);
+
+    lines = realloc(lines, (num_lines + 1) * sizeof(char *));
+    lines[num_lines] = NULL;
+    todo_alloc_count++;
+    return lines;
+}
+
+static int free_fgets_lines(char **lines) {
+    int num_lines = 0;
+    for (; lines[num_lines]; num_lines++) {
+        free(lines[num_lines]);
+    }
+    free(lines);
+    return num_lines;
+}
+
+static int count_lines(char **lines) {
+    int num_lines = 0;
+    while (lines[num_lines]) {
+        num_lines++;
+    }
+    return num_lines;
+}
+
+/**
+ * Compare the old fgets reader, get_all_lines() on top of the streaming
+ * reader, the streaming reader on its own and the mapped loader.
+ */
+static void bench_readers(void) {
+    size_t size = write_bench_file(BENCH_FILENAME, 500000, 3);
+    double mb = size / (1024.0 * 1024.0);
+    todos_filename = BENCH_FILENAME;
+
+    printf("readers: %.1f MiB file\n", mb);
+
+    for (int round = 0; round < 3; round++) {
+        double start = now();
+        int fgets_lines = free_fgets_lines(fgets_read_lines(BENCH_FILENAME));
+        double fgets_time = now() - start;
+
+        start = now();
+        int stream_lines = count_lines(get_all_lines());
+        free_all_lines();
+        double stream_time = now() - start;
+
+        start = now();
+        FILE *file = fopen(BENCH_FILENAME, "rb");
+        struct line_reader reader;
+        line_reader_open(&reader, file);
+        int reader_lines = 0;
+        size_t length;
+        while (line_reader_next(&reader, &length)) {
+            reader_lines++;
+        }
+        line_reader_close(&reader);
+        fclose(file);
+        double reader_time = now() - start;
+
+        start = now();
+        struct todo_doc doc;
+        int doc_lines = load_todo_doc(&doc, BENCH_FILENAME);
+        free_todo_doc(&doc);
+        double doc_time = now() - start;
+
+        printf("  fgets:  %8d lines %8.1f MiB/s\n", fgets_lines, mb / fgets_time);
+        printf("  stream: %8d lines %8.1f MiB/s\n", stream_lines, mb / stream_time);
+        printf("  reader: %8d lines %8.1f MiB/s (no copies)\n", reader_lines, mb / reader_time);
+        printf("  mapped: %8d lines %8.1f MiB/s\n", doc_lines, mb / doc_time);
+    }
+
+    remove(BENCH_FILENAME);
+}
+
+/**
+ * Compare classifying lines with strncmp on every string, like
+ * get_unfinished_tasks() and get_finished_tasks() do, against loading the
+ * file with the vectorized scanner, which classifies as it splits lines.
+ */
+static void bench_scan(void) {
+    size_t size = write_bench_file(BENCH_FILENAME, 1000000, 3);
+    double mb = size / (1024.0 * 1024.0);
+    todos_filename = BENCH_FILENAME;
+    todo_lines = get_all_lines();
+
+    printf("scan: %.1f MiB file\n", mb);
+
+    for (int round = 0; round < 3; round++) {
+        double start = now();
+        int unfinished_count = 0, finished_count = 0;
+        free(get_unfinished_tasks(&unfinished_count));
+        free(get_finished_tasks(&finished_count));
+        double strncmp_time = now() - start;
+
+        start = now();
+        struct todo_doc doc;
+        load_todo_doc(&doc, BENCH_FILENAME);
+        int kinds[3] = { 0, 0, 0 };
+        for (int i = 0; i < doc.num_lines; i++) {
+            kinds[doc.lines[i].kind]++;
+        }
+        free_todo_doc(&doc);
+        double scan_time = now() - start;
+
+        printf("  strncmp: %7d unfinished %7d finished %8.1f MiB/s (lines already split)\n",
+               unfinished_count, finished_count, mb / strncmp_time);
+        printf("  scanner: %7d unfinished %7d finished %8.1f MiB/s (including the load)\n",
+               kinds[LINE_UNFINISHED], kinds[LINE_FINISHED], mb / scan_time);
+    }
+
+    free_all_lines();
+    remove(BENCH_FILENAME);
+}
+
+/**
+ * Count the heap allocations needed to load a 1M line file with the old
+ * fgets reader, with get_all_lines() and with the mapped loader.
+ */
+static void bench_alloc(void) {
+    write_bench_file(BENCH_FILENAME, 1000000, 3);
+    todos_filename = BENCH_FILENAME;
+
+    todo_alloc_count = 0;
+    double start = now();
+    int num_lines = free_fgets_lines(fgets_read_lines(BENCH_FILENAME));
+    printf("alloc: %d lines\n", num_lines);
+    printf("  fgets:         %8zu allocations %8.3f s (including frees)\n", todo_alloc_count, now() - start);
+
+    todo_alloc_count = 0;
+    start = now();
+    get_all_lines();
+    free_all_lines();
+    printf("  get_all_lines: %8zu allocations %8.3f s\n", todo_alloc_count, now() - start);
+
+    todo_alloc_count = 0;
+    start = now();
+    struct todo_doc doc;
+    load_todo_doc(&doc, BENCH_FILENAME);
+    free_todo_doc(&doc);
+    printf("  load_todo_doc: %8zu allocations %8.3f s\n", todo_alloc_count, now() - start);
+
+    remove(BENCH_FILENAME);
+}
+
+/**
+ * Time loading a large file with 1, 2 and 4 parsing threads and with one
+ * thread per CPU.
+ */
+static void bench_parse(void) {
+    size_t size = write_bench_file(BENCH_FILENAME, 4000000, 3);
+    double mb = size / (1024.0 * 1024.0);
+    static const int threads[] = { 1, 2, 4, 0 };
+
+    printf("parse: %.1f MiB file\n", mb);
+
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        parse_threads = threads[i];
+        double best = 0;
+        for (int round = 0; round < 3; round++) {
+            double start = now();
+            struct todo_doc doc;
+            load_todo_doc(&doc, BENCH_FILENAME);
+            free_todo_doc(&doc);
+            double time = now() - start;
+            if (round == 0 || time < best) {
+                best = time;
+            }
+        }
+        if (threads[i]) {
+            printf("  %d threads:     %8.1f MiB/s\n", threads[i], mb / best);
+        } else {
+            printf("  one per CPU:   %8.1f MiB/s\n", mb / best);
+        }
+    }
+
+    parse_threads = 0;
+    remove(BENCH_FILENAME);
+}
+
+/**
+ * Compare parsing a 1M line file with reading its tables from the index, and
+ * with extending the index after a task is appended.
+ */
+static void bench_index(void) {
+    size_t size = write_bench_file(BENCH_FILENAME, 1000000, 3);
+    use_index = 1;
+    remove(".bench_todo.idx");
+
+    printf("index: %.1f MiB file\n", size / (1024.0 * 1024.0));
+
+    for (int round = 0; round < 4; round++) {
+        double start = now();
+        struct todo_doc doc;
+        load_todo_doc(&doc, BENCH_FILENAME);
+        free_todo_doc(&doc);
+        printf("  %s %8.2f ms\n", round == 0 ? "parse + write index:" : "read index:         ", (now() - start) * 1000);
+    }
+
+    // Grow the file by one task at a time, like add does
+    for (int round = 0; round < 3; round++) {
+        todos_filename = BENCH_FILENAME;
+        load_todo_doc(&todo_doc, BENCH_FILENAME);
+        add_todo("appended task");
+        save_todos();
+        free_todo_doc(&todo_doc);
+
+        struct todo_doc doc;
+        double start = now();
+        load_todo_doc(&doc, BENCH_FILENAME);
+        free_todo_doc(&doc);
+        printf("  after append:       %8.2f ms (parse the tail, update index)\n", (now() - start) * 1000);
+    }
+
+    use_index = 0;
+    remove(".bench_todo.idx");
+    remove(BENCH_FILENAME);
+}
+
+/**
+ * Time checking tasks 1 to 5000 of a 1M line file one at a time and as one
+ * batch, like "todo check 1 2 3 ... 5000" does, and looking up every task
+ * number once.
+ */
+static void bench_check(void) {
+    write_bench_file(BENCH_FILENAME, 1000000, 3);
+    todos_filename = BENCH_FILENAME;
+    load_todo_doc(&todo_doc, BENCH_FILENAME);
+
+    printf("check: %d unfinished tasks\n", todo_doc.num_unfinished);
+
+    static int indexes[5000];
+    for (int i = 0; i < 5000; i++) {
+        indexes[i] = i + 1;
+    }
+    double start = now();
+    update_tasks(indexes, 5000, LINE_FINISHED);
+    printf("  batch 1..5000:  %8.2f ms (one scan)\n", (now() - start) * 1000);
+
+    free_todo_doc(&todo_doc);
+    load_todo_doc(&todo_doc, BENCH_FILENAME);
+    start = now();
+    for (int index = 5000; index >= 1; index--) {
+        check_todo(index);
+    }
+    printf("  check 1..5000:  %8.2f ms (one at a time, including building the tree)\n", (now() - start) * 1000);
+
+    start = now();
+    long sum = 0;
+    for (int index = 1; index <= todo_doc.num_unfinished; index++) {
+        sum += find_unfinished_line(&todo_doc, index);
+    }
+    printf("  find every task: %7.2f ms (%ld)\n", (now() - start) * 1000, sum);
+
+    free_todo_doc(&todo_doc);
+    remove(BENCH_FILENAME);
+}
+
+/**
+ * Compare cleaning a file where half the tasks are finished the old way, with
+ * one delete_line() per finished task, against loading it, cleaning it with
+ * one sweep over the line table and saving it.
+ */
+static void bench_clean(void) {
+    static const int sizes[] = { 100000, 1000000 };
+    todos_filename = BENCH_FILENAME;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        write_bench_file(BENCH_FILENAME, sizes[i], 2);
+        printf("clean: %d tasks, half of them finished\n", sizes[i]);
+
+        // The old way is quadratic, so it would take hours on the larger file
+        if (sizes[i] <= 100000) {
+            double start = now();
+            todo_lines = get_all_lines();
+            int count = 0;
+            int *finished = get_finished_tasks(&count);
+            for (int j = count - 1; j >= 0; j--) {
+                delete_line(finished[j]);
+            }
+            free(finished);
+            free_all_lines();
+            printf("  delete_line:  %8.2f ms (without saving)\n", (now() - start) * 1000);
+        }
+
+        double start = now();
+        load_todo_doc(&todo_doc, BENCH_FILENAME);
+        double loaded = now();
+        remove_finished_tasks();
+        double cleaned = now();
+        save_todos();
+        free_todo_doc(&todo_doc);
+        printf("  sweep:        %8.2f ms (%.2f ms load, %.2f ms clean, %.2f ms save)\n", (now() - start) * 1000,
+               (loaded - start) * 1000, (cleaned - loaded) * 1000, (now() - cleaned) * 1000);
+    }
+
+    remove(BENCH_FILENAME);
+}
+
+/**
+ * Time 1000 adds, each loading and saving the file, with every durability
+ * mode. Batch mode commits every 10 ms, as a long running process would, and
+ * once per add, as separate commands do.
+ */
+static void bench_durability(void) {
+    static const struct {
+        const char *name;
+        int durability;
+        int interval;
+    } modes[] = {
+        { "none", DURABILITY_NONE, 0 },
+        { "batch, 10 ms", DURABILITY_BATCH, 10 },
+        { "batch, per add", DURABILITY_BATCH, 0 },
+        { "full", DURABILITY_FULL, 0 },
+    };
+    enum { NUM_ADDS = 1000 };
+    todos_filename = BENCH_FILENAME;
+
+    printf("durability: %d adds\n", NUM_ADDS);
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        write_bench_file(BENCH_FILENAME, 1000, 3);
+        durability = modes[i].durability;
+        sync_interval_ms = modes[i].interval;
+
+        double start = now();
+        double max_latency = 0;
+        for (int j = 0; j < NUM_ADDS; j++) {
+            double op_start = now();
+            load_todo_doc(&todo_doc, BENCH_FILENAME);
+            add_todo("a task added by a script");
+            save_todos();
+            free_todo_doc(&todo_doc);
+            commit_todos_if_due();
+            if (now() - op_start > max_latency) {
+                max_latency = now() - op_start;
+            }
+        }
+        commit_todos();
+        double time = now() - start;
+
+        printf("  %-15s %8.0f adds/s %8.3f ms average %8.3f ms max\n", modes[i].name, NUM_ADDS / time,
+               time * 1000 / NUM_ADDS, max_latency * 1000);
+    }
+
+    durability = DURABILITY_NONE;
+    sync_interval_ms = 100;
+    remove(BENCH_FILENAME);
+}
+
+#ifndef _WIN32
+/**
+ * One command of bench_lock(): add a task, or check the first one, with the
+ * file locked if locked is set.
+ */
+static void run_script_command(int add, int locked) {
+    if (locked && !lock_todos(1)) {
+        exit(EXIT_FAILURE);
+    }
+    load_todo_doc(&todo_doc, BENCH_FILENAME);
+    if (add) {
+        add_todo("a task added by a script");
+    } else {
+        check_todo(1);
+    }
+    save_todos();
+    free_todo_doc(&todo_doc);
+    unlock_todos();
+}
+
+/**
+ * Run several processes at once against the same file, each alternating
+ * between adding a task and checking the first one, like scripts running
+ * todo in parallel. Counting the tasks afterwards shows whether edits were
+ * lost; without locks, saves can still race each other between the check
+ * for a conflict and the write.
+ */
+static void bench_lock(void) {
+    enum { NUM_PROCESSES = 8, NUM_COMMANDS = 200 };
+    todos_filename = BENCH_FILENAME;
+
+    printf("lock: %d processes, %d commands each\n", NUM_PROCESSES, NUM_COMMANDS);
+
+    for (int locked = 1; locked >= 0; locked--) {
+        write_bench_file(BENCH_FILENAME, 1000, 3);
+        load_todo_doc(&todo_doc, BENCH_FILENAME);
+        int tasks_before = todo_doc.num_unfinished + todo_doc.num_finished;
+        int finished_before = todo_doc.num_finished;
+        free_todo_doc(&todo_doc);
+
+        fflush(stdout);
+        double start = now();
+        for (int i = 0; i < NUM_PROCESSES; i++) {
+            if (fork() == 0) {
+                // Conflicts are reported on stdout
+                if (!freopen("/dev/null", "w", stdout)) {
+                    _exit(EXIT_FAILURE);
+                }
+                for (int j = 0; j < NUM_COMMANDS; j++) {
+                    run_script_command(j % 2 == 0, locked);
+                }
+                _exit(EXIT_SUCCESS);
+            }
+        }
+        while (wait(NULL) > 0) {
+        }
+        double time = now() - start;
+
+        load_todo_doc(&todo_doc, BENCH_FILENAME);
+        int added = todo_doc.num_unfinished + todo_doc.num_finished - tasks_before;
+        int checked = todo_doc.num_finished - finished_before;
+        free_todo_doc(&todo_doc);
+        int expected = NUM_PROCESSES * NUM_COMMANDS / 2;
+        printf("  %-8s %8.0f commands/s, %d of %d adds and %d of %d checks lost\n",
+               locked ? "locked" : "unlocked", NUM_PROCESSES * NUM_COMMANDS / time, expected - added,
+               expected, expected - checked, expected);
+    }
+
+    remove(BENCH_FILENAME);
+    remove(".bench_todo.lock");
+    remove(".bench_todo.undo");
+}
+
+/**
+ * Compare checking tasks in a large file the way the CLI does, loading and
+ * saving the file for every command, with forwarding the commands to a
+ * server that keeps the file loaded and saves in batches.
+ */
+static void bench_serve(void) {
+    enum { NUM_LOCAL = 100, NUM_FORWARDED = 5000 };
+    write_bench_file(BENCH_FILENAME, 200000, 3);
+    todos_filename = BENCH_FILENAME;
+
+    printf("serve: checks on 200000 lines\n");
+
+    double start = now();
+    for (int i = 0; i < NUM_LOCAL; i++) {
+        load_todo_doc(&todo_doc, BENCH_FILENAME);
+        check_todo(1);
+        save_todos();
+        free_todo_doc(&todo_doc);
+    }
+    printf("  load, check, save: %8.1f us per command\n", (now() - start) * 1e6 / NUM_LOCAL);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!freopen("/dev/null", "w", stdout)) {
+            _exit(EXIT_FAILURE);
+        }
+        _exit(serve_todos());
+    }
+    struct stat st;
+    while (stat(".bench_todo.sock", &st) != 0) {
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
+    }
+
+    char *check[] = { "todo", "check", "1" };
+    int status;
+    start = now();
+    for (int i = 0; i < NUM_FORWARDED; i++) {
+        forward_command(3, check, 1, &status);
+    }
+    printf("  forwarded check:   %8.1f us per command\n", (now() - start) * 1e6 / NUM_FORWARDED);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    load_todo_doc(&todo_doc, BENCH_FILENAME);
+    printf("  %d unfinished tasks left\n", todo_doc.num_unfinished);
+    free_todo_doc(&todo_doc);
+
+    remove(BENCH_FILENAME);
+    remove(".bench_todo.lock");
+    remove(".bench_todo.undo");
+}
+
+/**
+ * Run one command of a script in a process of its own, the way a shell
+ * script running todo for every command does, with stdout discarded.
+ */
+static void run_in_process(int argc, char *argv[]) {
+    fflush(stdout);
+    if (fork() == 0) {
+        if (!freopen("/dev/null", "w", stdout) || !lock_todos(1)) {
+            _exit(EXIT_FAILURE);
+        }
+        load_todo_doc(&todo_doc, BENCH_FILENAME);
+        int status = strcmp(argv[1], "batch") == 0 ? run_batch(argc, argv, 1) : run_command(argc, argv, 1);
+        if (status == 0) {
+            save_todos();
+        }
+        _exit(status);
+    }
+    wait(NULL);
+}
+
+/**
+ * Compare running a script of adds, checks, removes and lists as one
+ * process per command with running it as one batch, which loads and saves
+ * the file once. Both have to end with the same file.
+ */
+static void bench_batch(void) {
+    enum { NUM_COMMANDS = 10000 };
+    static const char *commands[] = { "add a task added by a script", "check 1", "list --limit 3", "remove 2" };
+    todos_filename = BENCH_FILENAME;
+
+    printf("batch: %d commands on 10000 lines\n", NUM_COMMANDS);
+
+    FILE *script = fopen("bench_batch.txt", "w");
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        fprintf(script, "%s\n", commands[i % 4]);
+    }
+    fclose(script);
+
+    write_bench_file(BENCH_FILENAME, 10000, 3);
+    double start = now();
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        char command[64];
+        strcpy(command, commands[i % 4]);
+        char *argv[5] = { "todo" };
+        int argc = 1;
+        if (i % 4 == 0) {
+            argv[argc++] = command + 4;
+        } else {
+            for (char *word = strtok(command, " "); word; word = strtok(NULL, " ")) {
+                argv[argc++] = word;
+            }
+        }
+        run_in_process(argc, argv);
+    }
+    double time = now() - start;
+    printf("  a process per command: %8.1f us per command\n", time * 1e6 / NUM_COMMANDS);
+    rename(BENCH_FILENAME, "bench_separate.md");
+
+    write_bench_file(BENCH_FILENAME, 10000, 3);
+    start = now();
+    char *batch[] = { "todo", "batch", "bench_batch.txt" };
+    run_in_process(3, batch);
+    time = now() - start;
+    printf("  one batch:             %8.1f us per command\n", time * 1e6 / NUM_COMMANDS);
+    struct todo_doc separate, batched;
+    load_todo_doc(&separate, "bench_separate.md");
+    load_todo_doc(&batched, BENCH_FILENAME);
+    int same = separate.size == batched.size && memcmp(separate.data, batched.data, separate.size) == 0;
+    printf("  %d unfinished tasks left, %s\n", batched.num_unfinished, same ? "the same either way" : "BUT THE FILES DIFFER");
+    free_todo_doc(&separate);
+    free_todo_doc(&batched);
+
+    remove("bench_batch.txt");
+    remove("bench_separate.md");
+    remove(BENCH_FILENAME);
+    remove(".bench_todo.lock");
+    remove(".bench_todo.undo");
+}
+#endif
+
+/**
+ * Compare parsing a large file again after a task in it was edited with
+ * reparsing only the changed line, as `todo watch` does after every edit.
+ */
+static void bench_watch(void) {
+    enum { NUM_EDITS = 10 };
+    size_t size = write_bench_file(BENCH_FILENAME, 1000000, 3);
+    todos_filename = BENCH_FILENAME;
+    struct todo_doc doc = { 0 };
+    reload_changed_lines(&doc, BENCH_FILENAME);
+
+    printf("watch: %d lines, %.1f MB, %d edits\n", doc.num_lines, size / 1e6, NUM_EDITS);
+
+    char *data = malloc(size);
+    FILE *file = fopen(BENCH_FILENAME, "rb");
+    if (!data || !file || fread(data, 1, size, file) != size) {
+        perror("read");
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    double parse_time = 0;
+    double reload_time = 0;
+    for (int i = 0; i < NUM_EDITS; i++) {
+        // Rename a task somewhere in the file, like an editor saving it
+        char *task = strstr(data + size / NUM_EDITS * i, "task number");
+        task[0] = (char)toupper((unsigned char)task[0]);
+        file = fopen(BENCH_FILENAME, "wb");
+        fwrite(data, 1, size, file);
+        fclose(file);
+
+        double start = now();
+        struct todo_doc parsed;
+        load_todo_doc(&parsed, BENCH_FILENAME);
+        parse_time += now() - start;
+        free_todo_doc(&parsed);
+
+        start = now();
+        reload_changed_lines(&doc, BENCH_FILENAME);
+        reload_time += now() - start;
+    }
+    printf("  full parse:    %8.2f ms per edit\n", parse_time * 1000 / NUM_EDITS);
+    printf("  changed lines: %8.2f ms per edit, including reading the file\n", reload_time * 1000 / NUM_EDITS);
+
+    free(data);
+    free_todo_doc(&doc);
+    remove(BENCH_FILENAME);
+}
+
+/**
+ * Compare loading many files for one listing one after the other with
+ * loading them on the pool of threads. The listing is empty, so only
+ * loading and numbering the tasks is timed.
+ */
+static void bench_files(void) {
+    enum { NUM_FILES = 64, NUM_RUNS = 5 };
+    char names[NUM_FILES][32];
+    char *files[NUM_FILES];
+    size_t size = 0;
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(names[i], "bench_todo_%02d.md", i);
+        files[i] = names[i];
+        size += write_bench_file(names[i], 20000, 3);
+    }
+    char *list[] = { "todo", "list", "--limit", "0" };
+
+    printf("files: %d files of 20000 lines, %.1f MB\n", NUM_FILES, size / 1e6);
+
+    for (int threads = 1; threads >= 0; threads--) {
+        parse_threads = threads;
+        double start = now();
+        for (int run = 0; run < NUM_RUNS; run++) {
+            run_files(NUM_FILES, files, 4, list, 1);
+        }
+        printf("  %-12s %8.2f ms per listing\n", threads ? "one thread:" : "thread pool:",
+               (now() - start) * 1000 / NUM_RUNS);
+    }
+
+    for (int i = 0; i < NUM_FILES; i++) {
+        char lock[32];
+        sprintf(lock, ".%.*s.lock", 13, names[i]);
+        remove(lock);
+        remove(names[i]);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} benches[] = {
+    { "readers", bench_readers },
+    { "scan", bench_scan },
+    { "alloc", bench_alloc },
+    { "parse", bench_parse },
+    { "index", bench_index },
+    { "check", bench_check },
+    { "clean", bench_clean },
+    { "durability", bench_durability },
+    { "watch", bench_watch },
+    { "files", bench_files },
+#ifndef _WIN32
+    { "lock", bench_lock },
+    { "serve", bench_serve },
+    { "batch", bench_batch },
+#endif
+};
+
+int main(int argc, char *argv[]) {
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (argc < 2 || strcmp(argv[1], benches[i].name) == 0) {
+            benches[i].fn();
+        }
+    }
+    return 0;
+}
@@ -1,5 +1,20 @@
 #include "munit.h"
 #include "todo.h"
+#include <time.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define close _close
+#include <sys/utime.h>
+#else
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
 
 // Mock data for testing
 static char *mock_lines[] = {
@@ -31,6 +46,8 @@ static MunitResult test_add_todo(const MunitParameter params[], void *data) {
     remove(todos_filename);
 
     add_todo("New task");
+    save_todos();
+    free_todo_doc(&todo_doc);
 
     FILE *file = fopen(todos_filename, "r");
     munit_assert_not_null(file);
@@ -44,9 +61,1244 @@ static MunitResult test_add_todo(const MunitParameter params[], void *data) {
     return MUNIT_OK;
 }
 
+// Write contents to the given file, replacing it
+static void write_file(const char *filename, const char *contents) {
+    FILE *file = fopen(filename, "wb");
+    munit_assert_not_null(file);
+    fputs(contents, file);
+    fclose(file);
+}
+
+// Read the given file into a static buffer
+static const char *read_file(const char *filename) {
+    static char buffer[4096];
+    FILE *file = fopen(filename, "rb");
+    munit_assert_not_null(file);
+    size_t n = fread(buffer, 1, sizeof(buffer) - 1, file);
+    buffer[n] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+// Start sending stdout to a file, so that what a command prints can be checked
+static int capture_stdout(void) {
+    fflush(stdout);
+    int saved = dup(fileno(stdout));
+    munit_assert_not_null(freopen("test_stdout.txt", "w", stdout));
+    return saved;
+}
+
+// Restore stdout and return what was printed since capture_stdout
+static const char *captured_stdout(int saved) {
+    fflush(stdout);
+    dup2(saved, fileno(stdout));
+    close(saved);
+    const char *output = read_file("test_stdout.txt");
+    remove("test_stdout.txt");
+    return output;
+}
+
+// Test load_todo_doc, check_todo and save_todos on a mapped file
+static MunitResult test_load_todo_doc(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "# Todos\n- [ ] Task 1\n  - [x] Task 2\n- [ ] Task 3");
+
+    munit_assert_int(load_todo_doc(&todo_doc, todos_filename), ==, 4);
+    munit_assert_size(todo_doc.lines[1].offset, ==, 8);
+    munit_assert_size(todo_doc.lines[1].length, ==, 13);
+    munit_assert_size(todo_doc.lines[3].length, ==, 12);  // No trailing newline
+
+    check_todo(2);
+    remove_task(1);
+    save_todos();
+    free_todo_doc(&todo_doc);
+
+    munit_assert_string_equal(read_file(todos_filename), "# Todos\n  - [x] Task 2\n- [x] Task 3");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that get_all_lines keeps lines longer than a read block whole
+static MunitResult test_get_all_lines_long(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    FILE *file = fopen(todos_filename, "wb");
+    munit_assert_not_null(file);
+    fputs("- [ ] ", file);
+    for (int i = 0; i < READ_BLOCK_SIZE + 100; i++) {
+        fputc('a' + i % 26, file);
+    }
+    fputs("\n- [ ] short\n", file);
+    fclose(file);
+
+    todo_lines = get_all_lines();
+    munit_assert_not_null(todo_lines);
+    munit_assert_size(strlen(todo_lines[0]), ==, READ_BLOCK_SIZE + 107);
+    munit_assert_string_equal(todo_lines[1], "- [ ] short\n");
+    munit_assert_null(todo_lines[2]);
+
+    int count = 0;
+    free(get_unfinished_tasks(&count));
+    munit_assert_int(count, ==, 2);
+
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that the line scanner classifies like get_unfinished_tasks and
+// get_finished_tasks, with lines of all lengths across 64 byte blocks
+static MunitResult test_line_kinds(const MunitParameter params[], void *data) {
+    static const char *prefixes[] = { "", "- [ ] ", "- [x] ", "  - [ ] ", "\t- [x]", "- [y] ", "-[ ] ", "- [ ]" };
+    todos_filename = "test_todo.md";
+    FILE *file = fopen(todos_filename, "wb");
+    munit_assert_not_null(file);
+    for (int i = 0; i < 2000; i++) {
+        fputs(prefixes[munit_rand_int_range(0, 7)], file);
+        int length = munit_rand_int_range(0, 150);
+        for (int j = 0; j < length; j++) {
+            fputc('a' + j % 26, file);
+        }
+        fputc('\n', file);
+    }
+    fclose(file);
+
+    load_todo_doc(&todo_doc, todos_filename);
+    todo_lines = get_all_lines();
+
+    int unfinished_count = 0, finished_count = 0;
+    int *unfinished = get_unfinished_tasks(&unfinished_count);
+    int *finished = get_finished_tasks(&finished_count);
+    int u = 0, f = 0;
+    munit_assert_int(todo_doc.num_lines, ==, 2000);
+    for (int i = 0; i < todo_doc.num_lines; i++) {
+        int kind = LINE_OTHER;
+        if (u < unfinished_count && unfinished[u] == i) {
+            kind = LINE_UNFINISHED;
+            u++;
+        } else if (f < finished_count && finished[f] == i) {
+            kind = LINE_FINISHED;
+            f++;
+        }
+        munit_assert_int(todo_doc.lines[i].kind, ==, kind);
+    }
+
+    free(unfinished);
+    free(finished);
+    free_todo_doc(&todo_doc);
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that arena allocations keep their contents when they grow
+static MunitResult test_arena(const MunitParameter params[], void *data) {
+    struct arena arena = { 0 };
+
+    char *small = arena_alloc(&arena, 10);
+    strcpy(small, "small");
+    int *table = arena_alloc(&arena, 4 * sizeof(int));
+    for (int size = 4; size < 1000000; size *= 2) {
+        for (int i = size / 2; i < size; i++) {
+            table[i] = i;
+        }
+        table = arena_grow(&arena, table, size * sizeof(int), size * 2 * sizeof(int));
+    }
+    for (int i = 2; i < 1000000 / 2; i++) {
+        munit_assert_int(table[i], ==, i);
+    }
+    munit_assert_string_equal(small, "small");
+
+    arena_free(&arena);
+    munit_assert_null(arena.blocks);
+    return MUNIT_OK;
+}
+
+// Test the task tables through check_todo, remove_task and remove_finished_tasks
+static MunitResult test_task_tables(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [x] A\n\t- [ ] B\n- [ ]\n    - [ ] D\n- [x] E\n");
+    load_todo_doc(&todo_doc, todos_filename);
+
+    munit_assert_int(todo_doc.lines[1].indent, ==, 1);
+    munit_assert_int(todo_doc.lines[1].text, ==, 6);
+    munit_assert_int(todo_doc.lines[2].indent + todo_doc.lines[2].text, ==, todo_doc.lines[2].length);
+    munit_assert_int(todo_doc.num_unfinished, ==, 3);
+    munit_assert_int(todo_doc.num_finished, ==, 2);
+
+    check_todo(3);
+    check_todo(1);
+    munit_assert_int(todo_doc.num_unfinished, ==, 1);
+    munit_assert_int(find_unfinished_line(&todo_doc, 1), ==, 2);
+    munit_assert_int(todo_doc.num_finished, ==, 4);
+    static const int kinds[] = { LINE_FINISHED, LINE_FINISHED, LINE_UNFINISHED, LINE_FINISHED, LINE_FINISHED };
+    for (int i = 0; i < 5; i++) {
+        munit_assert_int(todo_doc.lines[i].kind, ==, kinds[i]);
+    }
+
+    remove_task(1);
+    remove_finished_tasks();
+    save_todos();
+    free_todo_doc(&todo_doc);
+
+    munit_assert_string_equal(read_file(todos_filename), "");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test the task numbering against a linear scan while tasks are checked and
+// removed in a pseudo random order
+static MunitResult test_unfinished_tree(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    FILE *file = fopen(todos_filename, "wb");
+    munit_assert_not_null(file);
+    for (int i = 0; file && i < 1000; i++) {
+        fprintf(file, i % 7 ? "- [ ] task %d\n" : "## %d\n", i);
+    }
+    fclose(file);
+    load_todo_doc(&todo_doc, todos_filename);
+
+    unsigned seed = 1;
+    while (todo_doc.num_unfinished > 0) {
+        seed = seed * 1103515245 + 12345;
+        int index = (int)(seed >> 16) % todo_doc.num_unfinished + 1;
+
+        int expected = -1;
+        for (int i = 0, count = 0; i < todo_doc.num_lines; i++) {
+            if (todo_doc.lines[i].kind == LINE_UNFINISHED && ++count == index) {
+                expected = i;
+                break;
+            }
+        }
+        munit_assert_int(find_unfinished_line(&todo_doc, index), ==, expected);
+
+        if (seed & 0x10000) {
+            check_todo(index);
+        } else {
+            remove_task(index);
+        }
+    }
+    munit_assert_int(find_unfinished_line(&todo_doc, 1), ==, -1);
+
+    free_todo_doc(&todo_doc);
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that update_tasks applies all indexes against the old numbering, once
+// each, and reports the ones past the last task
+static MunitResult test_update_tasks(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C\n- [ ] D\n- [ ] E\n");
+    load_todo_doc(&todo_doc, todos_filename);
+
+    int checked[] = { 1, 3, 3, 1 };
+    update_tasks(checked, 4, LINE_FINISHED);
+    munit_assert_int(todo_doc.num_unfinished, ==, 2);
+
+    int removed[] = { 2, 7, 1, 5 };
+    int saved = capture_stdout();
+    update_tasks(removed, 4, LINE_DELETED);
+    munit_assert_string_equal(captured_stdout(saved),
+                              "Invalid index: 7 (only 2 unfinished tasks)\n"
+                              "Invalid index: 5 (only 2 unfinished tasks)\n");
+
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(read_file(todos_filename), "- [x] A\n- [x] B\n- [x] D\n");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that saving after only checking tasks writes nothing but the markers
+static MunitResult test_save_patches(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C\n");
+    load_todo_doc(&todo_doc, todos_filename);
+
+    check_todo(2);
+    munit_assert_int(todo_doc.num_patches, ==, 1);
+    save_todos();
+    free_todo_doc(&todo_doc);
+
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] A\n- [x] B\n- [x] C\n");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that a file changed by someone else between loading and saving isn't
+// overwritten: the edits are made again on the new version of it
+static MunitResult test_save_conflict(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C\n- [ ] D\n");
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    check_todo(3);
+    remove_task(2);
+    add_todo("E");
+
+    // The tasks are found by their text, wherever they are now
+    write_file(todos_filename, "- [ ] New\n- [ ] A\n- [x] B\n- [ ] C\n- [ ] D\n");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] New\n- [ ] A\n- [x] B\n- [x] D\n- [ ] E\n");
+
+    // A task that is gone is skipped
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    remove_finished_tasks();
+    check_todo(1);
+    write_file(todos_filename, "- [ ] Renamed\n- [ ] A\n- [x] B\n- [x] D\n- [ ] E\n");
+    int saved = capture_stdout();
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(captured_stdout(saved), "\"New\" changed in test_todo.md meanwhile, so it wasn't checked.\n");
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] Renamed\n- [ ] A\n- [ ] E\n");
+
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that added lines go to the add buffer and are saved with the loaded
+// ones, both when only writing the changes and when rewriting the file
+static MunitResult test_add_buffer(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C");
+    load_todo_doc(&todo_doc, todos_filename);
+
+    munit_assert_int(find_unfinished_line(&todo_doc, 2), ==, 2);
+    add_todo("D");
+    add_todo("E");
+    munit_assert_int(todo_doc.num_unfinished, ==, 4);
+    munit_assert_int(find_unfinished_line(&todo_doc, 4), ==, 4);
+    check_todo(1);
+    check_todo(3);
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(read_file(todos_filename), "- [x] A\n- [x] B\n- [ ] C\n- [ ] D\n- [x] E\n");
+
+    load_todo_doc(&todo_doc, todos_filename);
+    add_todo("F");
+    remove_finished_tasks();
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] C\n- [ ] D\n- [ ] F\n");
+
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that saving in place leaves the file before the first removed line alone
+static MunitResult test_save_in_place(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C\n- [ ] D\n- [x] E\n");
+    load_todo_doc(&todo_doc, todos_filename);
+
+    remove_task(2);
+    remove_finished_tasks();
+    munit_assert_int(todo_doc.first_deleted, ==, 1);
+
+    FILE *file = fopen(todos_filename, "r+b");
+    munit_assert_not_null(file);
+    fseek(file, 6, SEEK_SET);
+    fputc('Z', file);
+    fclose(file);
+    save_todos();
+    free_todo_doc(&todo_doc);
+
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] Z\n- [ ] D\n");
+
+    // The lines after a removed one are moved up a few bytes, within the
+    // pages of the mapping they are written from; some lines are long
+    enum { NUM_LINES = 20000 };
+    char *expected = malloc(NUM_LINES * 320);
+    munit_assert_not_null(expected);
+    char long_text[301] = " ";
+    for (int i = 1; i < 300; i++) {
+        long_text[i] = "0123456789abcdef"[i % 16];
+    }
+    size_t size = 0;
+    size_t removed = 0;
+    for (int i = 0; i < NUM_LINES; i++) {
+        removed = i == 1 ? size : removed;
+        size += sprintf(expected + size, "- [ ] task %05d%s\n", i, i % 10 == 0 ? long_text : "");
+    }
+    write_file(todos_filename, expected);
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    remove_task(2);
+    save_todos();
+    free_todo_doc(&todo_doc);
+    memmove(expected + removed, expected + removed + 17, size - removed - 17 + 1);
+    size -= 17;
+
+    file = fopen(todos_filename, "rb");
+    munit_assert_not_null(file);
+    char *saved = malloc(size + 1);
+    munit_assert_size(fread(saved, 1, size + 1, file), ==, size);
+    fclose(file);
+    munit_assert_memory_equal(size, saved, expected);
+
+    free(saved);
+    free(expected);
+    remove(".test_todo.undo");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+#ifndef _WIN32
+// Test that an atomic save of a large file with removed lines, where most of
+// it is copied from the old file, gives the right contents and keeps the
+// permissions, and that one of a new file or through a link does the right
+// thing too
+static MunitResult test_save_atomic(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    enum { NUM_LINES = 20000, LINE_LENGTH = 17 };
+    char *expected = malloc(NUM_LINES * LINE_LENGTH + 1);
+    munit_assert_not_null(expected);
+    for (int i = 0; i < NUM_LINES; i++) {
+        sprintf(expected + i * LINE_LENGTH, "- [ ] task %05d\n", i);
+    }
+    write_file(todos_filename, expected);
+    chmod(todos_filename, 0640);
+    struct stat st;
+    munit_assert_int(stat(todos_filename, &st), ==, 0);
+    ino_t old_inode = st.st_ino;
+
+    atomic_save = 1;
+    load_todo_doc(&todo_doc, todos_filename);
+    check_todo(15000);
+    check_todo(5);
+    remove_task(10000);
+    save_todos();
+    free_todo_doc(&todo_doc);
+    atomic_save = 0;
+
+    expected[4 * LINE_LENGTH + 3] = 'x';
+    expected[14999 * LINE_LENGTH + 3] = 'x';
+    memmove(expected + 10000 * LINE_LENGTH, expected + 10001 * LINE_LENGTH, (NUM_LINES - 10001) * LINE_LENGTH + 1);
+    size_t size = (NUM_LINES - 1) * LINE_LENGTH;
+
+    FILE *file = fopen(todos_filename, "rb");
+    munit_assert_not_null(file);
+    char *saved = malloc(size + 1);
+    munit_assert_size(fread(saved, 1, size + 1, file), ==, size);
+    fclose(file);
+    munit_assert_memory_equal(size, saved, expected);
+
+    munit_assert_int(stat(todos_filename, &st), ==, 0);
+    munit_assert_int(st.st_mode & 0777, ==, 0640);
+    munit_assert_true(st.st_ino != old_inode);
+
+    free(saved);
+    free(expected);
+    remove(todos_filename);
+
+    // A new file gets the permissions a plain create gives it, and a link
+    // is followed to the file it points to
+    mode_t mask = umask(022);
+    atomic_save = 1;
+    load_todo_doc(&todo_doc, todos_filename);
+    add_todo("A");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_int(stat(todos_filename, &st), ==, 0);
+    munit_assert_int(st.st_mode & 0777, ==, 0644);
+
+    munit_assert_int(symlink(todos_filename, "test_link.md"), ==, 0);
+    todos_filename = "test_link.md";
+    load_todo_doc(&todo_doc, todos_filename);
+    add_todo("B");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    atomic_save = 0;
+    umask(mask);
+    munit_assert_int(lstat("test_link.md", &st), ==, 0);
+    munit_assert_true(S_ISLNK(st.st_mode));
+    munit_assert_string_equal(read_file("test_todo.md"), "- [ ] A\n- [ ] B\n");
+
+    remove("test_link.md");
+    remove(".test_link.undo");
+    remove(".test_todo.undo");
+    remove("test_todo.md");
+    return MUNIT_OK;
+}
+
+// Lock the test file in a child process, as another command would, and
+// return whether it got the lock
+static int child_locks(int exclusive) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        _exit(lock_todos(exclusive) ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Test that a shared lock lets others read but not write, that an exclusive
+// one keeps everyone out, and that waiting for it times out. Reading a file
+// that doesn't exist takes no lock.
+static MunitResult test_lock(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    lock_timeout_ms = 50;
+
+    // Reading a file that isn't there leaves no lock file behind
+    remove(todos_filename);
+    remove(".test_todo.lock");
+    munit_assert_true(lock_todos(0));
+    unlock_todos();
+    struct stat st;
+    munit_assert_int(stat(".test_todo.lock", &st), !=, 0);
+
+    write_file(todos_filename, "- [ ] A\n");
+    munit_assert_true(lock_todos(0));
+    munit_assert_true(child_locks(0));
+    munit_assert_false(child_locks(1));
+    unlock_todos();
+
+    munit_assert_true(lock_todos(1));
+    munit_assert_false(child_locks(0));
+    unlock_todos();
+    munit_assert_true(child_locks(1));
+
+    lock_timeout_ms = 10000;
+    remove(".test_todo.lock");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that commands are forwarded to a server for the file, which saves
+// them, and that without a server or with options they aren't
+static MunitResult test_serve(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n");
+    char *add[] = { "todo", "C" };
+    char *check[] = { "todo", "check", "1" };
+    char *list[] = { "todo", "list" };
+    int status = -1;
+    munit_assert_false(forward_command(2, add, 1, &status));
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        _exit(serve_todos());
+    }
+    struct stat st;
+    for (int i = 0; i < 200 && stat(".test_todo.sock", &st) != 0; i++) {
+        usleep(10000);
+    }
+
+    munit_assert_true(forward_command(2, add, 1, &status));
+    munit_assert_int(status, ==, 0);
+    munit_assert_true(forward_command(3, check, 1, &status));
+    int saved = capture_stdout();
+    munit_assert_true(forward_command(2, list, 1, &status));
+    munit_assert_true(forward_command(2, check, 1, &status));
+    munit_assert_string_equal(captured_stdout(saved), "1) C\nUsage: todo [<file.md>] check <index>\n");
+    munit_assert_int(status, ==, 1);
+
+    // A command with options of its own isn't sent but run here, and the
+    // server picks up the journal it writes
+    has_options = 1;
+    munit_assert_false(forward_command(2, list, 1, &status));
+    has_options = 0;
+    use_journal = 1;
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    add_todo("D");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    use_journal = 0;
+    saved = capture_stdout();
+    munit_assert_true(forward_command(2, list, 1, &status));
+    munit_assert_string_equal(captured_stdout(saved), "1) C\n2) D\n");
+
+    // The server saves what's left when it's stopped, the journal keeps D
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    munit_assert_string_equal(read_file(todos_filename), "- [x] A\n- [x] B\n- [ ] C\n");
+    munit_assert_true(has_journal());
+    munit_assert_int(stat(".test_todo.sock", &st), !=, 0);
+
+    remove(".test_todo.journal");
+    remove(".test_todo.lock");
+    remove(".test_todo.undo");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+#endif
+
+// Test that a batch runs its commands in order on one document, numbering
+// the tasks as they are after the commands before, and stops at a bad one or
+// at a line that isn't text
+static MunitResult test_batch(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C\n");
+    write_file("test_batch.txt", "# Comments and empty lines are skipped\n\nadd D and E\r\n"
+                                 "check 1\n  c 1\nlist\nremove 1\na F\nclean\n");
+    char *batch[] = { "todo", "batch", "test_batch.txt" };
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    int saved = capture_stdout();
+    munit_assert_int(run_batch(3, batch, 1), ==, 0);
+    munit_assert_string_equal(captured_stdout(saved), "1) D and E\n");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] F\n");
+
+    write_file("test_batch.txt", "add G\ncheck\nadd H\n");
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    saved = capture_stdout();
+    munit_assert_int(run_batch(3, batch, 1), ==, 1);
+    munit_assert_string_equal(captured_stdout(saved), "Usage: todo [<file.md>] check <index>\n"
+                                                      "Stopped at line 2 of test_batch.txt, nothing was saved.\n");
+    free_todo_doc(&todo_doc);
+
+    write_file("test_batch.txt", "undo\n");
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    saved = capture_stdout();
+    munit_assert_int(run_batch(3, batch, 1), ==, 1);
+    munit_assert_string_equal(captured_stdout(saved), "Unknown command: undo\n"
+                                                      "Stopped at line 1 of test_batch.txt, nothing was saved.\n");
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] F\n");
+
+    // A NUL byte ends the batch, even as the first byte of a line
+    FILE *file = fopen("test_batch.txt", "wb");
+    fwrite("list\n\0abc\nadd I\n", 1, 16, file);
+    fclose(file);
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    saved = capture_stdout();
+    munit_assert_int(run_batch(3, batch, 1), ==, 1);
+    munit_assert_string_equal(captured_stdout(saved), "1) F\nLine 2 of test_batch.txt has a NUL byte in it.\n"
+                                                      "Stopped at line 2 of test_batch.txt, nothing was saved.\n");
+    free_todo_doc(&todo_doc);
+
+    remove("test_batch.txt");
+    remove(".test_todo.undo");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that several files are numbered as one list, skipping a file given
+// twice, and that check and remove change the task in the right file
+static MunitResult test_files(const MunitParameter params[], void *data) {
+    write_file("test_a.md", "- [ ] A\n- [x] B\n- [ ] C\n");
+    write_file("test_b.md", "# B\n- [ ] D\n");
+    write_file("test_c.md", "- [ ] E\n- [ ] F");
+    char *files[] = { "test_a.md", "test_b.md", "./test_a.md", "test_c.md" };
+    char *list[] = { "todo", "list", "--offset", "1", "--limit", "3" };
+    char *check[] = { "todo", "check", "5", "2", "3" };
+    char *remove_all[] = { "todo", "remove", "1", "2", "3", "4" };
+
+    int saved = capture_stdout();
+    munit_assert_int(run_files(4, files, 6, list, 1), ==, 0);
+    munit_assert_string_equal(captured_stdout(saved), "test_a.md:\n2) C\ntest_b.md:\n3) D\ntest_c.md:\n4) E\n");
+
+    munit_assert_int(run_files(4, files, 5, check, 1), ==, 0);
+    munit_assert_string_equal(read_file("test_a.md"), "- [ ] A\n- [x] B\n- [x] C\n");
+    munit_assert_string_equal(read_file("test_b.md"), "# B\n- [x] D\n");
+    munit_assert_string_equal(read_file("test_c.md"), "- [ ] E\n- [x] F");
+
+    saved = capture_stdout();
+    munit_assert_int(run_files(4, files, 6, remove_all, 1), ==, 0);
+    munit_assert_string_equal(captured_stdout(saved), "Invalid index: 3 (only 2 unfinished tasks)\n"
+                                                      "Invalid index: 4 (only 2 unfinished tasks)\n");
+    munit_assert_string_equal(read_file("test_a.md"), "- [x] B\n- [x] C\n");
+    munit_assert_string_equal(read_file("test_c.md"), "- [x] F");
+
+    char *names[] = { "test_a.md", "test_b.md", "test_c.md" };
+    for (int i = 0; i < 3; i++) {
+        char lock[32], undo[32];
+        sprintf(lock, ".%.*s.lock", 6, names[i]);
+        sprintf(undo, ".%.*s.undo", 6, names[i]);
+        remove(lock);
+        remove(undo);
+        remove(names[i]);
+    }
+    return MUNIT_OK;
+}
+
+// Test that clean drops finished and removed lines from the table, and that
+// the numbering and saving work on the smaller table
+static MunitResult test_clean(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "# List\n- [x] A\n- [ ] B\n- [ ] C\n- [x] D\n- [ ] E\n");
+    load_todo_doc(&todo_doc, todos_filename);
+
+    munit_assert_int(find_unfinished_line(&todo_doc, 3), ==, 5);
+    remove_task(2);
+    remove_finished_tasks();
+    munit_assert_int(todo_doc.num_lines, ==, 3);
+    munit_assert_int(todo_doc.num_finished, ==, 0);
+    munit_assert_int(find_unfinished_line(&todo_doc, 2), ==, 2);
+
+    check_todo(2);
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(read_file(todos_filename), "# List\n- [ ] B\n- [x] E\n");
+
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that in journal mode edits go to the journal, are replayed over the
+// file, also after it was changed meanwhile, and are folded back into it when
+// compacting
+static MunitResult test_journal(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C\n");
+    remove(".test_todo.journal");
+    use_journal = 1;
+
+    load_todo_doc(&todo_doc, todos_filename);
+    munit_assert_int(replay_journal(), ==, 0);
+    add_todo("D");
+    check_todo(2);
+    remove_task(1);
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] A\n- [x] B\n- [ ] C\n");
+
+    load_todo_doc(&todo_doc, todos_filename);
+    munit_assert_int(replay_journal(), ==, 3);
+    int saved = capture_stdout();
+    list_todos();
+    munit_assert_string_equal(captured_stdout(saved), "1) D\n");
+    compact_journal();
+    free_todo_doc(&todo_doc);
+    munit_assert_false(has_journal());
+    munit_assert_string_equal(read_file(todos_filename), "- [x] B\n- [x] C\n- [ ] D\n");
+
+    // The journal is compacted on its own once it gets large
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    for (int i = 0; has_journal() || i == 0; i++) {
+        add_todo("a task to fill the journal");
+        save_todos();
+    }
+    free_todo_doc(&todo_doc);
+    load_todo_doc(&todo_doc, todos_filename);
+    munit_assert_int(todo_doc.num_unfinished, >, 1000);
+    free_todo_doc(&todo_doc);
+
+    // The journal still applies after the file is changed meanwhile, and a
+    // task that is gone is skipped
+    write_file(todos_filename, "- [ ] A\n- [ ] B\n");
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    add_todo("J1");
+    check_todo(1);
+    remove_task(1);
+    save_todos();
+    free_todo_doc(&todo_doc);
+    write_file(todos_filename, "- [ ] X\n- [ ] A\n");
+    load_todo_doc(&todo_doc, todos_filename);
+    saved = capture_stdout();
+    munit_assert_int(replay_journal(), ==, 3);
+    munit_assert_string_equal(captured_stdout(saved), "\"B\" changed in test_todo.md meanwhile, so it wasn't removed.\n");
+    add_todo("J2");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    load_todo_doc(&todo_doc, todos_filename);
+    saved = capture_stdout();
+    replay_journal();
+    list_todos();
+    compact_journal();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(captured_stdout(saved), "\"B\" changed in test_todo.md meanwhile, so it wasn't removed.\n"
+                                                      "1) X\n2) J1\n3) J2\n");
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] X\n- [x] A\n- [ ] J1\n- [ ] J2\n");
+
+    // A file in the journal's place that isn't one is left alone
+    write_file(".test_todo.journal", "not a journal\n");
+    load_todo_doc(&todo_doc, todos_filename);
+    saved = capture_stdout();
+    replay_journal();
+    add_todo("J3");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(captured_stdout(saved), "Ignoring .test_todo.journal, it isn't a journal; "
+                                                      "edits are saved to test_todo.md directly.\n");
+    munit_assert_string_equal(read_file(".test_todo.journal"), "not a journal\n");
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] X\n- [x] A\n- [ ] J1\n- [ ] J2\n- [ ] J3\n");
+
+    use_journal = 0;
+    remove(".test_todo.journal");
+    remove(".test_todo.undo");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that saves can be undone and redone, only as long as nothing else
+// changed the file, and that the log keeps the last UNDO_DEPTH saves
+static MunitResult test_undo(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "# List\n- [ ] A\n- [ ] B\n- [ ] C");
+    remove(".test_todo.undo");
+
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    check_todo(2);
+    remove_task(1);
+    add_todo("D");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    remove_finished_tasks();
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_string_equal(read_file(todos_filename), "# List\n- [ ] C\n- [ ] D\n");
+
+    int saved = capture_stdout();
+    undo_change(0);
+    munit_assert_string_equal(read_file(todos_filename), "# List\n- [x] B\n- [ ] C\n- [ ] D\n");
+    undo_change(0);
+    munit_assert_string_equal(read_file(todos_filename), "# List\n- [ ] A\n- [ ] B\n- [ ] C");
+    undo_change(0);
+    undo_change(1);
+    munit_assert_string_equal(read_file(todos_filename), "# List\n- [x] B\n- [ ] C\n- [ ] D\n");
+    munit_assert_string_equal(captured_stdout(saved), "Nothing to undo.\n");
+
+    // A file changed some other way is left alone, even if its size and
+    // contents are the same again
+    struct utimbuf times = { .actime = 1000000000, .modtime = 1000000000 };
+    utime(todos_filename, &times);
+    saved = capture_stdout();
+    undo_change(0);
+    write_file(todos_filename, "- [ ] E\n");
+    undo_change(0);
+    munit_assert_string_equal(captured_stdout(saved), "test_todo.md was changed since, can't undo.\n"
+                                                      "test_todo.md was changed since, can't undo.\n");
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] E\n");
+
+    // A new save drops what was undone, and only the last saves are kept
+    for (int i = 0; i < UNDO_DEPTH + 2; i++) {
+        load_todo_doc(&todo_doc, todos_filename);
+        replay_journal();
+        add_todo("F");
+        save_todos();
+        free_todo_doc(&todo_doc);
+    }
+    saved = capture_stdout();
+    for (int i = 0; i < UNDO_DEPTH + 1; i++) {
+        undo_change(0);
+    }
+    undo_change(1);
+    munit_assert_string_equal(captured_stdout(saved), "Nothing to undo.\n");
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] E\n- [ ] F\n- [ ] F\n- [ ] F\n");
+
+    // A hunk running past its entry is reported, not followed. The header
+    // starts with the magic, the position and count and then the offsets,
+    // and each entry with 40 bytes before its first hunk.
+    load_todo_doc(&todo_doc, todos_filename);
+    add_todo("G");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    FILE *log = fopen(".test_todo.undo", "r+b");
+    int32_t count;
+    uint64_t offset;
+    munit_assert_int(fseek(log, 12, SEEK_SET), ==, 0);
+    munit_assert_size(fread(&count, sizeof(count), 1, log), ==, 1);
+    munit_assert_int(fseek(log, 16 + 8 * (count - 1), SEEK_SET), ==, 0);
+    munit_assert_size(fread(&offset, sizeof(offset), 1, log), ==, 1);
+    uint64_t lengths[2] = { UINT64_MAX / 2, UINT64_MAX / 2 };
+    munit_assert_int(fseek(log, (long)offset + 40 + 8, SEEK_SET), ==, 0);
+    munit_assert_size(fwrite(lengths, sizeof(lengths), 1, log), ==, 1);
+    fclose(log);
+    saved = capture_stdout();
+    undo_change(0);
+    munit_assert_string_equal(captured_stdout(saved), "The undo log of test_todo.md is damaged.\n");
+    munit_assert_string_equal(read_file(todos_filename), "- [ ] E\n- [ ] F\n- [ ] F\n- [ ] F\n- [ ] G\n");
+    remove(".test_todo.undo");
+
+#ifndef _WIN32
+    // Undo through a link changes the file it points to
+    munit_assert_int(symlink(todos_filename, "test_link.md"), ==, 0);
+    todos_filename = "test_link.md";
+    load_todo_doc(&todo_doc, todos_filename);
+    check_todo(1);
+    save_todos();
+    free_todo_doc(&todo_doc);
+    undo_change(0);
+    struct stat st;
+    munit_assert_int(lstat("test_link.md", &st), ==, 0);
+    munit_assert_true(S_ISLNK(st.st_mode));
+    munit_assert_string_equal(read_file("test_todo.md"), "- [ ] E\n- [ ] F\n- [ ] F\n- [ ] F\n- [ ] G\n");
+    remove("test_link.md");
+    remove(".test_link.undo");
+    todos_filename = "test_todo.md";
+#endif
+
+    remove(".test_todo.undo");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Check that a document reloaded by reload_changed_lines() has the line
+// table a full parse of the file gives
+static void assert_reloaded(struct todo_doc *doc) {
+    struct todo_doc parsed;
+    load_todo_doc(&parsed, "test_todo.md");
+    munit_assert_int(doc->num_lines, ==, parsed.num_lines);
+    munit_assert_int(doc->num_unfinished, ==, parsed.num_unfinished);
+    munit_assert_int(doc->num_finished, ==, parsed.num_finished);
+    munit_assert_memory_equal(parsed.num_lines * sizeof(struct todo_line), doc->lines, parsed.lines);
+    free_todo_doc(&parsed);
+}
+
+// Test that reloading a changed file only parses what changed but gives the
+// same table, and tells whether the unfinished tasks changed
+static MunitResult test_reload_changed_lines(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    struct todo_doc doc = { 0 };
+    write_file(todos_filename, "# A\n- [ ] one\n- [x] two\n\n# B\n- [ ] three\n- [ ] four");
+    munit_assert_true(reload_changed_lines(&doc, todos_filename));
+    assert_reloaded(&doc);
+
+    static const struct {
+        const char *contents;
+        int changed;
+    } versions[] = {
+        { "# A\n- [ ] one\n- [x] two\n\n# B\n- [ ] three\n- [ ] four", 0 },
+        { "# A\n- [ ] one\n- [x] two\n\n# Section B\n- [ ] three\n- [ ] four", 0 },
+        { "# A\n- [ ] one\n- [x] 2\n\n# Section B\n- [ ] three\n- [ ] four", 0 },
+        { "# A\n- [ ] one\n- [x] 2\n\n# Section B\n- [ ] three\n- [ ] four\n", 1 },
+        { "# A\n- [ ] one\n- [x] 2\n\n# Section B\n- [ ] three\n- [ ] four\n- [ ] five\n", 1 },
+        { "# A\n- [ ] one\n- [ ] one and a half\n- [x] 2\n\n# Section B\n- [ ] three\n- [ ] four\n- [ ] five\n", 1 },
+        { "# A\n- [ ] one\n- [ ] one and a half\n- [x] 2\n\n# Section B\n- [x] three\n- [ ] four\n- [ ] five\n", 1 },
+        { "- [ ] one\n- [ ] one and a half\n- [x] 2\n\n# Section B\n- [x] three\n- [ ] four\n- [ ] five\n", 0 },
+        { "- [ ] one\n- [ ] five\n", 1 },
+        { "- [ ] one\n- [ ] one\n- [ ] five\n", 1 },
+        { "", 1 },
+    };
+    for (size_t i = 0; i < sizeof(versions) / sizeof(versions[0]); i++) {
+        write_file(todos_filename, versions[i].contents);
+        munit_assert_int(reload_changed_lines(&doc, todos_filename), ==, versions[i].changed);
+        assert_reloaded(&doc);
+    }
+
+    // Random edits, from characters that make and break tasks and lines
+    char contents[512] = "";
+    for (int i = 0; i < 500; i++) {
+        size_t length = strlen(contents);
+        size_t at = munit_rand_uint32() % (length + 1);
+        size_t removed = munit_rand_uint32() % ((length - at < 8 ? length - at : 8) + 1);
+        char inserted[8];
+        int count = length > 400 ? 0 : (int)(munit_rand_uint32() % 8);
+        for (int j = 0; j < count; j++) {
+            inserted[j] = "- [ x]\na"[munit_rand_uint32() % 8];
+        }
+        memmove(contents + at + count, contents + at + removed, length - at - removed + 1);
+        memcpy(contents + at, inserted, count);
+        write_file(todos_filename, contents);
+        reload_changed_lines(&doc, todos_filename);
+        assert_reloaded(&doc);
+    }
+
+    free_todo_doc(&doc);
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that parsing a large file in parallel gives the same tables as parsing
+// it on one thread
+static MunitResult test_parallel_parse(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    FILE *file = fopen(todos_filename, "wb");
+    munit_assert_not_null(file);
+    for (int i = 0; file && ftell(file) < 3 * PARALLEL_PARSE_CHUNK_SIZE + 1000; i++) {
+        fprintf(file, "%*s- [%c] task %d\n", i % 4, "", i % 3 ? ' ' : 'x', i);
+    }
+    fputs("- [ ] last", file);
+    fclose(file);
+
+    struct todo_doc serial, parallel;
+    parse_threads = 1;
+    load_todo_doc(&serial, todos_filename);
+    parse_threads = 3;
+    load_todo_doc(&parallel, todos_filename);
+
+    munit_assert_int(parallel.num_lines, ==, serial.num_lines);
+    munit_assert_int(parallel.num_unfinished, ==, serial.num_unfinished);
+    munit_assert_int(parallel.num_finished, ==, serial.num_finished);
+    munit_assert_memory_equal(serial.num_lines * sizeof(struct todo_line), parallel.lines, serial.lines);
+
+    free_todo_doc(&serial);
+    free_todo_doc(&parallel);
+    parse_threads = 0;
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that list_todos_window numbers tasks like list_todos and stops early
+static MunitResult test_list_todos_window(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C\ntext\n  - [ ] D\n- [ ] E\n");
+
+    int saved = capture_stdout();
+    list_todos_window(1, 2);
+    munit_assert_string_equal(captured_stdout(saved), "2) C\n3) D\n");
+
+    saved = capture_stdout();
+    list_todos_window(3, -1);
+    munit_assert_string_equal(captured_stdout(saved), "4) E\n");
+
+    saved = capture_stdout();
+    list_todos_window(4, 10);
+    munit_assert_string_equal(captured_stdout(saved), "No unfinished tasks found.\n");
+
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that the sidecar index is written, used, and ignored once the file
+// changes, even when size and modification time stay the same
+static MunitResult test_index(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    struct utimbuf times = { .actime = 1000000000, .modtime = 1000000000 };
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C\n");
+    utime(todos_filename, &times);
+    use_index = 1;
+
+    struct todo_doc parsed, indexed;
+    load_todo_doc(&parsed, todos_filename);
+    FILE *index = fopen(".test_todo.idx", "rb");
+    munit_assert_not_null(index);
+    fclose(index);
+
+    munit_assert_int(load_todo_doc(&indexed, todos_filename), ==, 3);
+    munit_assert_memory_equal(3 * sizeof(struct todo_line), indexed.lines, parsed.lines);
+    munit_assert_int(indexed.num_unfinished, ==, 2);
+    munit_assert_int(find_unfinished_line(&indexed, 2), ==, 2);
+    munit_assert_int(indexed.num_finished, ==, 1);
+    free_todo_doc(&indexed);
+
+    // Same size and time, different tasks
+    write_file(todos_filename, "- [x] A\n- [ ] B\n- [x] C\n");
+    utime(todos_filename, &times);
+    load_todo_doc(&indexed, todos_filename);
+    munit_assert_int(indexed.num_unfinished, ==, 1);
+    munit_assert_int(find_unfinished_line(&indexed, 1), ==, 1);
+    free_todo_doc(&parsed);
+    free_todo_doc(&indexed);
+
+    // Same size and time with the edit in a block content_hash() doesn't
+    // sample: the stale index is used, but no byte outside a task is touched
+    FILE *file = fopen(todos_filename, "wb");
+    for (int i = 0; i < 6000; i++) {
+        fprintf(file, "- [ ] Task %05d\n", i);
+    }
+    fclose(file);
+    utime(todos_filename, &times);
+    load_todo_doc(&todo_doc, todos_filename);
+    free_todo_doc(&todo_doc);
+
+    file = fopen(todos_filename, "r+b");
+    fseek(file, 530 * 17, SEEK_SET);
+    fputs("## long headings\n", file);
+    fclose(file);
+    utime(todos_filename, &times);
+
+    load_todo_doc(&todo_doc, todos_filename);
+    int saved = capture_stdout();
+    check_todo(531);
+    munit_assert_string_equal(captured_stdout(saved),
+                              "Line 531 isn't an unfinished task any more; leaving it as it is.\n");
+    munit_assert_memory_equal(17, line_data(&todo_doc, &todo_doc.lines[530]), "## long headings\n");
+    munit_assert_int(todo_doc.num_unfinished, ==, 6000);
+    free_todo_doc(&todo_doc);
+
+    use_index = 0;
+    remove(".test_todo.idx");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that an index is extended when the file grows, including when the old
+// last line had no newline, but not when the old part was edited as well
+static MunitResult test_index_append(const MunitParameter params[], void *data) {
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n- [x] B\n- [ ] C");
+    use_index = 1;
+
+    struct todo_doc appended, parsed;
+    load_todo_doc(&appended, todos_filename);
+    free_todo_doc(&appended);
+
+    FILE *file = fopen(todos_filename, "ab");
+    fputs("D\n- [x] E\n- [ ] F\n", file);
+    fclose(file);
+
+    load_todo_doc(&appended, todos_filename);
+    use_index = 0;
+    load_todo_doc(&parsed, todos_filename);
+
+    munit_assert_int(appended.num_lines, ==, 5);
+    munit_assert_memory_equal(5 * sizeof(struct todo_line), appended.lines, parsed.lines);
+    munit_assert_int(appended.num_unfinished, ==, 3);
+    munit_assert_int(appended.num_finished, ==, 2);
+
+    // The index was brought up to date
+    struct todo_doc indexed = { 0 };
+    indexed.data = parsed.data;
+    indexed.size = parsed.size;
+    indexed.identity = parsed.identity;
+    munit_assert_int(read_index(&indexed, todos_filename), ==, 1);
+    arena_free(&indexed.arena);
+    free_todo_doc(&appended);
+    free_todo_doc(&parsed);
+
+    // An edit of the same length in a block that content_hash() doesn't
+    // sample, with a task appended: the file has to be parsed again. 6000
+    // lines of 17 bytes make 25 blocks of 4 KiB, and the third isn't sampled.
+    file = fopen(todos_filename, "wb");
+    for (int i = 0; i < 6000; i++) {
+        fprintf(file, "- [ ] Task %05d\n", i);
+    }
+    fclose(file);
+    use_index = 1;
+    load_todo_doc(&appended, todos_filename);
+    free_todo_doc(&appended);
+
+    file = fopen(todos_filename, "r+b");
+    fseek(file, 530 * 17, SEEK_SET);
+    fputs("## long headings\n", file);
+    fseek(file, 0, SEEK_END);
+    fputs("- [ ] G\n", file);
+    fclose(file);
+
+    load_todo_doc(&appended, todos_filename);
+    use_index = 0;
+    load_todo_doc(&parsed, todos_filename);
+    munit_assert_int(appended.num_lines, ==, 6001);
+    munit_assert_memory_equal(6001 * sizeof(struct todo_line), appended.lines, parsed.lines);
+    munit_assert_int(appended.num_unfinished, ==, 6000);
+
+    free_todo_doc(&appended);
+    free_todo_doc(&parsed);
+    remove(".test_todo.idx");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
+// Test that only known options are taken before the file name, so that a
+// task may still start with "--", and that "--" ends them
+static MunitResult test_options(const MunitParameter params[], void *data) {
+    char *args[] = { "todo", "--index", "--lock-timeout=50", "--fix flags" };
+    int index = 1;
+    munit_assert_true(parse_options(4, args, &index));
+    munit_assert_int(index, ==, 3);
+    munit_assert_int(use_index, ==, 1);
+    munit_assert_int(lock_timeout_ms, ==, 50);
+
+    char *ended[] = { "todo", "--atomic", "--", "--journal" };
+    index = 1;
+    munit_assert_true(parse_options(4, ended, &index));
+    munit_assert_int(index, ==, 3);
+    munit_assert_int(atomic_save, ==, 1);
+    munit_assert_int(use_journal, ==, 0);
+
+    char *invalid[] = { "todo", "--lock-timeout=soon", "list" };
+    index = 1;
+    int saved = capture_stdout();
+    munit_assert_false(parse_options(3, invalid, &index));
+    munit_assert_string_equal(captured_stdout(saved), "Invalid lock timeout: soon\n");
+
+    use_index = 0;
+    atomic_save = 0;
+    lock_timeout_ms = 10000;
+    return MUNIT_OK;
+}
+
+// Test the --durability option, and that with DURABILITY_BATCH saves are
+// noted until they're committed, by commit_todos_if_due() only once the
+// first of them is sync_interval_ms old
+static MunitResult test_durability(const MunitParameter params[], void *data) {
+    char *args[] = { "todo", "--durability=batch:30", "--durability=sometimes" };
+    int index = 1;
+    int saved = capture_stdout();
+    munit_assert_false(parse_options(3, args, &index));
+    munit_assert_string_equal(captured_stdout(saved), "Unknown durability: sometimes\n");
+    munit_assert_int(durability, ==, DURABILITY_BATCH);
+    munit_assert_int(sync_interval_ms, ==, 30);
+
+    char *invalid[] = { "todo", "--durability=batch:" };
+    index = 1;
+    saved = capture_stdout();
+    munit_assert_false(parse_options(2, invalid, &index));
+    munit_assert_string_equal(captured_stdout(saved), "Unknown durability: batch:\n");
+
+    todos_filename = "test_todo.md";
+    write_file(todos_filename, "- [ ] A\n");
+    struct timespec start, now;
+    timespec_get(&start, TIME_UTC);
+    load_todo_doc(&todo_doc, todos_filename);
+    check_todo(1);
+    save_todos();
+    free_todo_doc(&todo_doc);
+    double elapsed = 0;
+    while (todos_unsynced() && elapsed < 1) {
+        commit_todos_if_due();
+        timespec_get(&now, TIME_UTC);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    }
+    munit_assert_false(todos_unsynced());
+    munit_assert_double(elapsed, >=, 0.03);
+
+    // Without batching nothing is left for a commit
+    char *full[] = { "todo", "--durability=full", "list" };
+    index = 1;
+    munit_assert_true(parse_options(3, full, &index));
+    munit_assert_int(index, ==, 2);
+    munit_assert_int(durability, ==, DURABILITY_FULL);
+    load_todo_doc(&todo_doc, todos_filename);
+    add_todo("B");
+    save_todos();
+    free_todo_doc(&todo_doc);
+    munit_assert_false(todos_unsynced());
+
+    durability = DURABILITY_NONE;
+    sync_interval_ms = 100;
+    remove(".test_todo.undo");
+    remove(todos_filename);
+    return MUNIT_OK;
+}
+
 static MunitTest tests[] = {
     { "/get_unfinished_tasks", test_get_unfinished_tasks, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { "/add_todo", test_add_todo, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/get_all_lines_long", test_get_all_lines_long, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/load_todo_doc", test_load_todo_doc, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/task_tables", test_task_tables, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/unfinished_tree", test_unfinished_tree, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/update_tasks", test_update_tasks, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/save_patches", test_save_patches, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/save_conflict", test_save_conflict, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/add_buffer", test_add_buffer, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/save_in_place", test_save_in_place, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+#ifndef _WIN32
+    { "/save_atomic", test_save_atomic, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/lock", test_lock, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/serve", test_serve, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+#endif
+    { "/batch", test_batch, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/files", test_files, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/clean", test_clean, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/journal", test_journal, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/undo", test_undo, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/reload_changed_lines", test_reload_changed_lines, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/parallel_parse", test_parallel_parse, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/arena", test_arena, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/list_todos_window", test_list_todos_window, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/index", test_index, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/index_append", test_index_append, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/line_kinds", test_line_kinds, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/options", test_options, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+    { "/durability", test_durability, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
     { NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
 
@@ -1,7 +1,57 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // For copy_file_range()
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define SCAN_X86 1
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SCAN_NEON 1
+#endif
+
+#include <sys/stat.h>
+
+#if defined(__APPLE__)
+#define ST_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#elif defined(_WIN32)
+#define ST_MTIME_NSEC(st) 0
+#else
+#define ST_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#else
+#include <io.h>
+#define fsync _commit
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
 
 #include "todo.h"
 
@@ -41,7 +91,22 @@
  */
 
 const char *todos_filename = NULL;
+struct todo_doc todo_doc;
 char **todo_lines = NULL;
+size_t todo_alloc_count = 0;
+int parse_threads = 0;
+int use_index = 0;
+int atomic_save = 0;
+int use_journal = 0;
+int durability = DURABILITY_NONE;
+int sync_interval_ms = 100;
+int lock_timeout_ms = 10000;
+int has_options = 0;
+
+/**
+ * Arena owning the strings and array returned by get_all_lines().
+ */
+static struct arena lines_arena;
 
 /**
  * Print usage instructions to the console.
@@ -50,9 +115,29 @@ void print_usage(const char *prog_name) {
     printf("Usage:\n");
     printf("  %s [<file.md>] \"<task>\"           - Add a new task (default file: todo.md).\n", prog_name);
     printf("  %s [<file.md>] l(ist)             - List all unfinished tasks.\n", prog_name);
+    printf("  %s [<file.md>] l(ist) [--limit <n>] [--offset <m>]\n", prog_name);
+    printf("                                    - List <n> unfinished tasks, skipping the first <m>.\n");
     printf("  %s [<file.md>] c(heck) <index>    - Mark the <index>th unfinished task as finished.\n", prog_name);
     printf("  %s [<file.md>] r(emove) <index>   - Remove the <index>th unfinished task.\n", prog_name);
     printf("  %s [<file.md>] clean              - Remove all finished tasks.\n", prog_name);
+    printf("  %s [<file.md>] compact            - Fold the journal back into the file.\n", prog_name);
+    printf("  %s [<file.md>] undo               - Undo the last change to the file.\n", prog_name);
+    printf("  %s [<file.md>] redo               - Redo the last undone change.\n", prog_name);
+    printf("  %s [<file.md>] serve              - Keep the file loaded and run the commands on it.\n", prog_name);
+    printf("  %s [<file.md>] watch              - List the unfinished tasks again whenever they change.\n", prog_name);
+    printf("  %s [<file.md>] batch [<script>]   - Run the commands in <script> (or stdin), saving once.\n", prog_name);
+    printf("  %s <file.md>... l(ist)|c(heck)|r(emove)|clean\n", prog_name);
+    printf("                                    - Number the tasks of several files as one list.\n");
+    printf("\n");
+    printf("Options (before the file name):\n");
+    printf("  --index                           - Keep an index of the file in .<file>.idx to skip parsing it.\n");
+    printf("  --atomic                          - Save by replacing the whole file, safe against crashes.\n");
+    printf("  --journal                         - Append edits to .<file>.journal instead of saving the file.\n");
+    printf("  --durability=none|batch[:<ms>]|full\n");
+    printf("                                    - Sync saves to disk never, once per command (or every <ms>\n");
+    printf("                                      in long running modes), or after every save.\n");
+    printf("  --lock-timeout=<ms>               - Wait at most <ms> for other commands on the file (default 10000).\n");
+    printf("  --                                - End the options, e.g. to add a task starting with \"--\".\n");
     printf("\n");
     printf("You can also use multiple <index>es for check and remove commands, i.e. todo check 1 2 3.\n");
 }
@@ -69,339 +154,3955 @@ char *skip_leading_whitespace(char *str) {
 }
 
 /**
- * Read all lines from the todo file into a NULL-terminated array of strings.
- * Returns NULL if the file doesn't exist or is empty.
+ * malloc() that counts the allocation and exits when out of memory.
  */
-char **get_all_lines(void) {
-    FILE *file = fopen(todos_filename, "r");
-    if (!file) {
-        // It's not necessarily an error if the file doesn't exist;
-        // we may be creating a new one.
-        return NULL;
+void *todo_malloc(size_t size) {
+    void *ptr = malloc(size);
+    if (!ptr) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
     }
+    __atomic_fetch_add(&todo_alloc_count, 1, __ATOMIC_RELAXED);
+    return ptr;
+}
 
-    char line[MAX_LINE_LENGTH];
-    char **lines = NULL;
-    int num_lines = 0;
-
-    while (fgets(line, sizeof(line), file)) {
-        num_lines++;
-        lines = realloc(lines, num_lines * sizeof(char *));
-        if (!lines) {
-            perror("realloc");
-            fclose(file);
-            exit(EXIT_FAILURE);
-        }
-        lines[num_lines - 1] = strdup(line);
+/**
+ * realloc() that counts the allocation and exits when out of memory.
+ */
+void *todo_realloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (!ptr) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
     }
-    fclose(file);
+    __atomic_fetch_add(&todo_alloc_count, 1, __ATOMIC_RELAXED);
+    return ptr;
+}
 
-    if (num_lines == 0) {
-        free(lines);
-        return NULL;
+/**
+ * Return the path of a sidecar file for filename: the file's name without
+ * ".md", prefixed with a dot and followed by extension, in the same directory.
+ * For "docs/todo.md" and ".idx" that is "docs/.todo.idx". The caller frees
+ * the result.
+ */
+char *sidecar_path(const char *filename, const char *extension) {
+    const char *base = strrchr(filename, '/');
+#ifdef _WIN32
+    const char *backslash = strrchr(filename, '\\');
+    if (backslash && (!base || backslash > base)) {
+        base = backslash;
     }
+#endif
+    base = base ? base + 1 : filename;
 
-    // Null-terminate the array
-    lines = realloc(lines, (num_lines + 1) * sizeof(char *));
-    lines[num_lines] = NULL;
+    size_t base_length = strlen(base);
+    if (base_length > 3 && strcmp(base + base_length - 3, ".md") == 0) {
+        base_length -= 3;
+    }
 
-    return lines;
+    size_t dir_length = base - filename;
+    char *path = todo_malloc(dir_length + 1 + base_length + strlen(extension) + 1);
+    memcpy(path, filename, dir_length);
+    path[dir_length] = '.';
+    memcpy(path + dir_length + 1, base, base_length);
+    strcpy(path + dir_length + 1 + base_length, extension);
+    return path;
 }
 
+#ifndef _WIN32
 /**
- * Return the line numbers of all unfinished tasks (those starting with "- [ ]"),
- * along with a count of how many there are.
- *
- * @param count_out Output parameter for number of unfinished tasks.
- * @return Pointer to a dynamically allocated int array (line indices).
+ * The permissions open() gives a new file with mode 0666, for the files
+ * mkstemp() creates, which only their owner can read.
  */
-int *get_unfinished_tasks(int *count_out) {
-    int *unfinished_tasks = NULL;
-    int num_unfinished = 0;
+static mode_t default_mode(void) {
+    mode_t mask = umask(0);
+    umask(mask);
+    return 0666 & ~mask;
+}
+#endif
 
-    if (!todo_lines) {
-        *count_out = 0;
-        return NULL;
+#define HASH_SAMPLES 16
+#define HASH_SAMPLE_SIZE 4096
+
+/**
+ * A fast hash of the contents of a file: FNV-1a over its size and up to
+ * HASH_SAMPLES blocks of HASH_SAMPLE_SIZE bytes spread evenly over it,
+ * including the first and the last block. It doesn't read the whole file, so
+ * it's meant to back up size and modification time, not replace them.
+ */
+uint64_t content_hash(const char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ ((size >> (i * 8)) & 0xff)) * 1099511628211ULL;
     }
 
-    for (int i = 0; todo_lines[i]; i++) {
-        char *trimmed_line = skip_leading_whitespace(todo_lines[i]);
-        if (strncmp(trimmed_line, "- [ ]", 5) == 0) {
-            num_unfinished++;
-            unfinished_tasks = realloc(unfinished_tasks, num_unfinished * sizeof(int));
-            if (!unfinished_tasks) {
-                perror("realloc");
-                exit(EXIT_FAILURE);
-            }
-            unfinished_tasks[num_unfinished - 1] = i;
+    size_t blocks = (size + HASH_SAMPLE_SIZE - 1) / HASH_SAMPLE_SIZE;
+    size_t samples = blocks < HASH_SAMPLES ? blocks : HASH_SAMPLES;
+    for (size_t i = 0; i < samples; i++) {
+        size_t block = samples > 1 ? i * (blocks - 1) / (samples - 1) : 0;
+        size_t start = block * HASH_SAMPLE_SIZE;
+        size_t end = start + HASH_SAMPLE_SIZE < size ? start + HASH_SAMPLE_SIZE : size;
+        for (size_t j = start; j < end; j++) {
+            hash = (hash ^ (unsigned char)data[j]) * 1099511628211ULL;
         }
     }
-
-    *count_out = num_unfinished;
-    return unfinished_tasks;
+    return hash;
 }
 
+struct arena_block {
+    struct arena_block *next;
+    _Alignas(16) char data[];
+};
+
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
 /**
- * Return the line numbers of all finished tasks (those starting with "- [x]"),
- * along with a count of how many there are.
- *
- * @param count_out Output parameter for number of finished tasks.
- * @return Pointer to a dynamically allocated int array (line indices).
+ * Allocate size bytes from arena. Requests that don't fit into a regular
+ * block get a block of their own, which arena_grow() can then resize.
  */
-int *get_finished_tasks(int *count_out) {
-    int *finished_tasks = NULL;
-    int num_finished = 0;
-
-    if (!todo_lines) {
-        *count_out = 0;
-        return NULL;
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = ARENA_ALIGN(size);
+    if (!arena->next || (size_t)(arena->end - arena->next) < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        struct arena_block *block = todo_malloc(sizeof(struct arena_block) + block_size);
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->next = block->data;
+        arena->end = block->data + block_size;
     }
 
-    for (int i = 0; todo_lines[i]; i++) {
-        char *trimmed_line = skip_leading_whitespace(todo_lines[i]);
-        if (strncmp(trimmed_line, "- [x]", 5) == 0) {
-            num_finished++;
-            finished_tasks = realloc(finished_tasks, num_finished * sizeof(int));
-            if (!finished_tasks) {
-                perror("realloc");
-                exit(EXIT_FAILURE);
-            }
-            finished_tasks[num_finished - 1] = i;
+    arena->top = arena->next;
+    arena->next += size;
+    return arena->top;
+}
+
+/**
+ * Resize an allocation from arena, keeping its contents. The most recent
+ * allocation grows in place while its block has room, and an allocation with
+ * a block of its own is resized with the block, so a table that keeps
+ * doubling costs a handful of reallocs instead of a copy per step.
+ */
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (ptr && ptr == arena->top) {
+        if ((size_t)(arena->end - arena->top) >= ARENA_ALIGN(new_size)) {
+            arena->next = arena->top + ARENA_ALIGN(new_size);
+            return ptr;
+        }
+        if (ptr == arena->blocks->data) {
+            new_size = ARENA_ALIGN(new_size);
+            struct arena_block *block = todo_realloc(arena->blocks, sizeof(struct arena_block) + new_size);
+            arena->blocks = block;
+            arena->top = block->data;
+            arena->next = arena->end = block->data + new_size;
+            return block->data;
         }
     }
 
-    *count_out = num_finished;
-    return finished_tasks;
+    void *copy = arena_alloc(arena, new_size);
+    if (old_size) {
+        memcpy(copy, ptr, old_size);
+    }
+    return copy;
 }
 
 /**
- * Delete a line from todo_lines (shift everything up).
- *
- * @param line_index Index in todo_lines to delete.
+ * Release everything allocated from arena.
  */
-void delete_line(int line_index) {
-    free(todo_lines[line_index]);
-    // Shift lines down
-    for (int i = line_index; todo_lines[i]; i++) {
-        todo_lines[i] = todo_lines[i + 1];
+void arena_free(struct arena *arena) {
+    struct arena_block *block = arena->blocks;
+    while (block) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
     }
+    memset(arena, 0, sizeof(*arena));
+}
+
+/**
+ * Start reading lines from file in READ_BLOCK_SIZE blocks.
+ */
+void line_reader_open(struct line_reader *reader, FILE *file) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = file;
+    reader->capacity = READ_BLOCK_SIZE;
+    reader->buffer = todo_malloc(reader->capacity);
 }
 
 /**
- * Remove all finished tasks from todo_lines.
+ * Return the next line, including its newline, and store its length in
+ * length_out. Returns NULL at the end of the stream.
  *
- * We remove from last to first so indices are not messed up after each removal.
+ * The buffer works as a ring: once the data runs out, the unfinished line is
+ * moved to the front and the rest of the buffer is refilled with one large
+ * read. The buffer only grows when a single line doesn't fit into it, so
+ * lines of any length come back whole.
  */
-void remove_finished_tasks(void) {
-    int count = 0;
-    int *finished_tasks = get_finished_tasks(&count);
-    if (!finished_tasks || count == 0) {
-        printf("No finished tasks found.\n");
-        free(finished_tasks);
-        return;
-    }
+const char *line_reader_next(struct line_reader *reader, size_t *length_out) {
+    for (;;) {
+        char *newline = memchr(reader->buffer + reader->scan, '\n', reader->end - reader->scan);
+        if (newline) {
+            const char *line = reader->buffer + reader->start;
+            size_t line_end = (size_t)(newline - reader->buffer) + 1;
+            *length_out = line_end - reader->start;
+            reader->start = reader->scan = line_end;
+            return line;
+        }
+        reader->scan = reader->end;
+
+        if (reader->eof) {
+            if (reader->start == reader->end) {
+                return NULL;
+            }
+            // The last line has no newline
+            const char *line = reader->buffer + reader->start;
+            *length_out = reader->end - reader->start;
+            reader->start = reader->scan = reader->end;
+            return line;
+        }
 
-    // Remove from bottom to top
-    for (int i = count - 1; i >= 0; i--) {
-        delete_line(finished_tasks[i]);
+        if (reader->start > 0) {
+            size_t pending = reader->end - reader->start;
+            memmove(reader->buffer, reader->buffer + reader->start, pending);
+            reader->start = 0;
+            reader->scan = reader->end = pending;
+        }
+        if (reader->end == reader->capacity) {
+            reader->capacity *= 2;
+            reader->buffer = todo_realloc(reader->buffer, reader->capacity);
+        }
+
+        size_t n = fread(reader->buffer + reader->end, 1, reader->capacity - reader->end, reader->file);
+        if (n == 0) {
+            reader->eof = 1;
+        }
+        reader->end += n;
     }
-    free(finished_tasks);
 }
 
 /**
- * Remove the Nth unfinished task (1-based index).
+ * Release the reader's buffer. The stream itself is left open.
  */
-void remove_task(int index) {
-    if (index <= 0) {
-        printf("Invalid index: %d\n", index);
-        return;
-    }
+void line_reader_close(struct line_reader *reader) {
+    free(reader->buffer);
+    memset(reader, 0, sizeof(*reader));
+}
 
-    int count = 0;
-    int *unfinished_tasks = get_unfinished_tasks(&count);
-    if (!unfinished_tasks || count == 0) {
-        printf("No unfinished tasks found.\n");
-        free(unfinished_tasks);
-        return;
+/**
+ * Read a whole file into a buffer allocated from arena. Used where the file
+ * can't be mapped. Returns NULL if the file doesn't exist or is empty.
+ */
+static char *read_whole_file(const char *filename, struct arena *arena, size_t *size_out) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return NULL;
     }
 
-    if (index > count) {
-        printf("Invalid index: %d (only %d unfinished tasks)\n", index, count);
-        free(unfinished_tasks);
-        return;
+    char *data = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+
+    for (;;) {
+        if (size == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64 * 1024;
+            data = arena_grow(arena, data, capacity, new_capacity);
+            capacity = new_capacity;
+        }
+        size_t n = fread(data + size, 1, capacity - size, file);
+        if (n == 0) {
+            break;
+        }
+        size += n;
     }
+    fclose(file);
 
-    // Convert the user's 1-based index to the line index in todo_lines
-    int line_index = unfinished_tasks[index - 1];
-    delete_line(line_index);
+    if (size == 0) {
+        return NULL;
+    }
 
-    free(unfinished_tasks);
+    *size_out = size;
+    return data;
 }
 
-/**
- * Check (mark done) the Nth unfinished task, i.e., the line that begins with "- [ ]".
- *
- * @param index The 1-based index of the unfinished task to mark as finished.
+/*
+ * Line scanning. The buffer is searched for newlines 64 bytes at a time with
+ * vector compares, producing one bit per byte, and every line start found that
+ * way is classified right away while it is still in cache. That keeps the
+ * scan a single pass over the buffer.
  */
-void check_todo(int index) {
-    if (index <= 0) {
-        printf("Invalid index: %d\n", index);
-        return;
+
+#define SCAN_BLOCKS 64
+
+#if SCAN_X86
+
+static void newline_masks_sse2(const char *p, size_t blocks, uint64_t *masks) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (size_t i = 0; i < blocks; i++, p += 64) {
+        uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+        uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16)), nl));
+        uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 32)), nl));
+        uint64_t m3 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 48)), nl));
+        masks[i] = m0 | m1 << 16 | m2 << 32 | m3 << 48;
     }
+}
 
-    int count = 0;
-    int *unfinished_tasks = get_unfinished_tasks(&count);
-    if (!unfinished_tasks || count == 0) {
-        printf("No unfinished tasks found.\n");
-        free(unfinished_tasks);
-        return;
+#if defined(__GNUC__)
+__attribute__((target("avx2")))
+static void newline_masks_avx2(const char *p, size_t blocks, uint64_t *masks) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for (size_t i = 0; i < blocks; i++, p += 64) {
+        uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), nl));
+        uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), nl));
+        masks[i] = lo | hi << 32;
     }
+}
+#endif
 
-    if (index > count) {
-        printf("Invalid index: %d (only %d unfinished tasks)\n", index, count);
-        free(unfinished_tasks);
-        return;
+#elif SCAN_NEON
+
+static void newline_masks_neon(const char *p, size_t blocks, uint64_t *masks) {
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t bits = vld1q_u8(weights);
+    const uint8x16_t nl = vdupq_n_u8('\n');
+    for (size_t i = 0; i < blocks; i++, p += 64) {
+        // NEON has no movemask, so weight each matching byte by its bit and
+        // add neighbouring bytes together until 64 bits are left
+        uint8x16_t m0 = vandq_u8(vceqq_u8(vld1q_u8((const uint8_t *)p), nl), bits);
+        uint8x16_t m1 = vandq_u8(vceqq_u8(vld1q_u8((const uint8_t *)(p + 16)), nl), bits);
+        uint8x16_t m2 = vandq_u8(vceqq_u8(vld1q_u8((const uint8_t *)(p + 32)), nl), bits);
+        uint8x16_t m3 = vandq_u8(vceqq_u8(vld1q_u8((const uint8_t *)(p + 48)), nl), bits);
+        uint8x16_t sum = vpaddq_u8(vpaddq_u8(m0, m1), vpaddq_u8(m2, m3));
+        sum = vpaddq_u8(sum, sum);
+        masks[i] = vgetq_lane_u64(vreinterpretq_u64_u8(sum), 0);
     }
+}
 
-    int line_index = unfinished_tasks[index - 1];
-    char *trimmed_line = skip_leading_whitespace(todo_lines[line_index]);
+#else
 
-    // If it's indeed "- [ ]", replace with "- [x]"
-    if (strncmp(trimmed_line, "- [ ]", 5) == 0) {
-        // Overwrite the bracket portion
-        strncpy(trimmed_line, "- [x]", 5);
+static void newline_masks_scalar(const char *p, size_t blocks, uint64_t *masks) {
+    for (size_t i = 0; i < blocks; i++, p += 64) {
+        uint64_t mask = 0;
+        for (int j = 0; j < 64; j++) {
+            mask |= (uint64_t)(p[j] == '\n') << j;
+        }
+        masks[i] = mask;
     }
+}
 
-    free(unfinished_tasks);
+#endif
+
+typedef void (*newline_masks_fn)(const char *p, size_t blocks, uint64_t *masks);
+
+/**
+ * Pick the fastest newline search the CPU supports.
+ */
+static newline_masks_fn pick_newline_masks(void) {
+#if SCAN_X86
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        return newline_masks_avx2;
+    }
+#endif
+    return newline_masks_sse2;
+#elif SCAN_NEON
+    return newline_masks_neon;
+#else
+    return newline_masks_scalar;
+#endif
 }
 
 /**
- * List all unfinished tasks (lines beginning with "- [ ]") from todo_lines
- * with their 1-based indices.
+ * Classify a line as an unfinished task, a finished task or other text and
+ * record where its marker and text are. Leading whitespace is skipped like
+ * skip_leading_whitespace() does.
  */
-void list_todos(void) {
-    int count = 0;
-    int *unfinished_tasks = get_unfinished_tasks(&count);
-    if (!unfinished_tasks || count == 0) {
-        printf("No unfinished tasks found.\n");
-        free(unfinished_tasks);
-        return;
+static void classify_line(const char *data, struct todo_line *line) {
+    const char *start = data + line->offset;
+    const char *end = start + line->length;
+    const char *marker = start;
+    while (marker < end && (*marker == ' ' || (*marker >= '\t' && *marker <= '\r'))) {
+        marker++;
     }
 
-    for (int i = 0; i < count; i++) {
-        int line_index = unfinished_tasks[i];
-        char *trimmed_line = skip_leading_whitespace(todo_lines[line_index]);
-        // Print as "1) something"
-        printf("%d) %s", i + 1, trimmed_line + 6);
+    line->kind = LINE_OTHER;
+    line->indent = 0;
+    line->text = 0;
+
+    if (end - marker < 5 || marker - start > UINT16_MAX ||
+        marker[0] != '-' || marker[1] != ' ' || marker[2] != '[' || marker[4] != ']') {
+        return;
+    }
+    if (marker[3] == ' ') {
+        line->kind = LINE_UNFINISHED;
+    } else if (marker[3] == 'x') {
+        line->kind = LINE_FINISHED;
+    } else {
+        return;
     }
 
-    free(unfinished_tasks);
+    // The text follows "- [ ] ", or is empty for a bare "- [ ]"
+    line->indent = (uint16_t)(marker - start);
+    line->text = end - marker > 5 ? 6 : 5;
 }
 
+_Static_assert(sizeof(struct todo_line) == 16, "line table entries should stay compact");
+
 /**
- * Append a new task in Markdown format ("- [ ] <task>") to the current file.
- * 
- * If the last line in the file has no newline at the end, adds a newline before the new task.
- *
- * @param task The text of the task to add.
+ * Append the line [start, end) of doc->data to doc->lines.
  */
-void add_todo(const char *task) {
-    FILE *file = fopen(todos_filename, "a");
-    if (!file) {
-        printf("Error opening %s for appending.\n", todos_filename);
-        return;
+static void add_doc_line(struct todo_doc *doc, int *capacity, size_t start, size_t end) {
+    if (doc->num_lines == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 1024;
+        doc->lines = arena_grow(&doc->arena, doc->lines, *capacity * sizeof(struct todo_line),
+                                new_capacity * sizeof(struct todo_line));
+        *capacity = new_capacity;
+    }
+    if (end - start > UINT32_MAX) {
+        fprintf(stderr, "Line %d of %s is too long.\n", doc->num_lines + 1, todos_filename);
+        exit(EXIT_FAILURE);
     }
 
-    if (todo_lines) {
-        // Find the last line in the array
-        int i = 0;
-        while (todo_lines[i + 1] != NULL) {
-            i++;
+    struct todo_line *line = &doc->lines[doc->num_lines++];
+    line->offset = start;
+    line->length = (uint32_t)(end - start);
+    classify_line(doc->data, line);
+    doc->num_unfinished += line->kind == LINE_UNFINISHED;
+    doc->num_finished += line->kind == LINE_FINISHED;
+}
+
+/**
+ * Build the table of line views for doc->data from offset start, which must
+ * be the start of a line, to doc->size in one pass.
+ */
+static void index_lines(struct todo_doc *doc, size_t start) {
+    newline_masks_fn newline_masks = pick_newline_masks();
+    uint64_t masks[SCAN_BLOCKS];
+    int capacity = 0;
+    size_t line_start = start;
+    size_t pos = start;
+
+    while (pos < doc->size) {
+        size_t blocks = (doc->size - pos) / 64;
+        if (blocks > SCAN_BLOCKS) {
+            blocks = SCAN_BLOCKS;
+        }
+
+        if (blocks > 0) {
+            newline_masks(doc->data + pos, blocks, masks);
+        } else {
+            // Less than a block is left, so scan a zero padded copy of it
+            char tail[64] = { 0 };
+            memcpy(tail, doc->data + pos, doc->size - pos);
+            newline_masks(tail, 1, masks);
+            blocks = 1;
         }
-        char *last_line = todo_lines[i];
-        
-        // Check if last_line ends with a newline
-        size_t len = strlen(last_line);
-        if (len > 0 && last_line[len - 1] != '\n') {
-            fprintf(file, "\n");
+
+        for (size_t i = 0; i < blocks; i++) {
+            uint64_t mask = masks[i];
+            while (mask) {
+                size_t end = pos + i * 64 + __builtin_ctzll(mask) + 1;
+                mask &= mask - 1;
+                add_doc_line(doc, &capacity, line_start, end);
+                line_start = end;
+            }
         }
+        pos += blocks * 64;
     }
 
-    fprintf(file, "- [ ] %s\n", task);
-    fclose(file);
+    // The last line may have no newline
+    if (line_start < doc->size) {
+        add_doc_line(doc, &capacity, line_start, doc->size);
+    }
 }
 
 /**
- * Save todo_lines to the current file (overwrite).
+ * Run fn on each of count items, item_size bytes apart, each on its own
+ * thread, and wait until all of them are done. The first item runs on the
+ * calling thread; without thread support everything does.
  */
-void save_todos(void) {
-    // If we have never read any lines, there's nothing to save
-    if (!todo_lines) return;
+static void run_parallel(void *(*fn)(void *), void *items, size_t item_size, int count) {
+#ifndef _WIN32
+    pthread_t threads[MAX_THREADS];
+    int started[MAX_THREADS] = { 0 };
 
-    FILE *file = fopen(todos_filename, "w");
-    if (!file) {
-        printf("Error opening %s for writing.\n", todos_filename);
-        return;
+    for (int i = 1; i < count && i < MAX_THREADS; i++) {
+        started[i] = pthread_create(&threads[i], NULL, fn, (char *)items + i * item_size) == 0;
     }
-
-    for (int i = 0; todo_lines[i]; i++) {
-        fprintf(file, "%s", todo_lines[i]);
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || i >= MAX_THREADS || !started[i]) {
+            fn((char *)items + i * item_size);
+        }
+    }
+    for (int i = 1; i < count && i < MAX_THREADS; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        fn((char *)items + i * item_size);
     }
+#endif
+}
 
-    fclose(file);
+/**
+ * Number of threads to use for count pieces of work: parse_threads if set,
+ * otherwise one per CPU.
+ */
+static int thread_count(int count) {
+    int threads = parse_threads;
+    if (threads <= 0) {
+#ifndef _WIN32
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+#else
+        threads = 1;
+#endif
+    }
+    if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+    return threads < count ? threads : count;
 }
 
 /**
- * Comparison function for descending order of two ints.
- * Used by qsort() when we want to process bigger indexes first.
+ * One chunk of a document parsed on its own thread. The chunk's lines are
+ * scanned into part, a document over the same buffer with its own table, and
+ * then copied into the real document at the base given by a prefix sum of
+ * the chunk line counts.
  */
-int compare_int_desc(const void *a, const void *b) {
-    int ai = *(const int *)a;
-    int bi = *(const int *)b;
-    // Return negative if bi < ai so that bigger numbers come first
-    return (bi - ai);
+struct parse_chunk {
+    struct todo_doc *doc;
+    struct todo_doc part;
+    size_t start;
+    int line_base;
+};
+
+static void *scan_chunk(void *arg) {
+    struct parse_chunk *chunk = arg;
+    index_lines(&chunk->part, chunk->start);
+    return NULL;
+}
+
+static void *merge_chunk(void *arg) {
+    struct parse_chunk *chunk = arg;
+    struct todo_doc *doc = chunk->doc;
+    memcpy(doc->lines + chunk->line_base, chunk->part.lines, chunk->part.num_lines * sizeof(struct todo_line));
+    arena_free(&chunk->part.arena);
+    return NULL;
 }
 
 /**
- * Calls function pointer for each index in the given arguments.
- * 
- * @param argc Number of arguments.
- * @param argv Array of arguments.
- * @param index Index of the first index argument.
- * @param fn Function pointer to a void function that takes an int.
- * @return 0 if successful, 1 if there was an error.
+ * Build the line table of doc. Large documents are split into chunks at line
+ * boundaries which are scanned in parallel; a prefix sum over the per chunk
+ * line counts then tells every chunk where its lines go, so the result, and
+ * with it the task numbering, is exactly that of a sequential scan.
  */
-int call_fn_with_indexes(int argc, char *argv[], int index, void (*fn)(int)) {
-    // Collect all indexes into an array
-    int numIndexes = 0;
-    int capacity = argc - index;
-    int *indexes = malloc(capacity * sizeof(int));
-    if (!indexes) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+static void parse_lines(struct todo_doc *doc) {
+    int num_chunks = thread_count((int)(doc->size / PARALLEL_PARSE_CHUNK_SIZE));
+    if (num_chunks <= 1) {
+        index_lines(doc, 0);
+        return;
     }
 
-    // Parse all remaining arguments as indexes
-    for (int i = index; i < argc; i++) {
-        int idx = atoi(argv[i]);
-        if (idx <= 0) {
-            printf("Skipping invalid index: %s\n", argv[i]);
-            continue;
+    struct parse_chunk chunks[MAX_THREADS];
+    size_t start = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        size_t end = doc->size;
+        if (i < num_chunks - 1) {
+            end = doc->size / num_chunks * (i + 1);
+            const char *newline = end > start ? memchr(doc->data + end, '\n', doc->size - end) : NULL;
+            end = newline ? (size_t)(newline - doc->data) + 1 : (end > start ? doc->size : start);
         }
-        indexes[numIndexes++] = idx;
+        memset(&chunks[i], 0, sizeof(chunks[i]));
+        chunks[i].doc = doc;
+        chunks[i].part.data = doc->data;
+        chunks[i].part.size = end;
+        chunks[i].start = start;
+        start = end;
     }
 
-    // Sort the indexes in descending order so we handle highest first
-    qsort(indexes, numIndexes, sizeof(int), compare_int_desc);
+    run_parallel(scan_chunk, chunks, sizeof(chunks[0]), num_chunks);
 
-    // Call the fn on each requested index
-    for (int i = 0; i < numIndexes; i++) {
-        fn(indexes[i]);
+    for (int i = 0; i < num_chunks; i++) {
+        chunks[i].line_base = doc->num_lines;
+        doc->num_lines += chunks[i].part.num_lines;
+        doc->num_unfinished += chunks[i].part.num_unfinished;
+        doc->num_finished += chunks[i].part.num_finished;
     }
+    doc->lines = arena_alloc(&doc->arena, doc->num_lines * sizeof(struct todo_line));
 
-    free(indexes);
+    run_parallel(merge_chunk, chunks, sizeof(chunks[0]), num_chunks);
+}
+
+/**
+ * Count the tasks in doc's line table.
+ */
+static void count_tasks(struct todo_doc *doc) {
+    doc->num_unfinished = doc->num_finished = 0;
+    for (int i = 0; i < doc->num_lines; i++) {
+        doc->num_unfinished += doc->lines[i].kind == LINE_UNFINISHED;
+        doc->num_finished += doc->lines[i].kind == LINE_FINISHED;
+    }
+}
+
+/*
+ * Task numbers. The Nth unfinished task is found with a Fenwick tree over the
+ * line table, where line i counts 1 if it is an unfinished task. That makes
+ * both looking up a task number and checking or removing a task O(log n), so
+ * a long run of edits never rescans the table. The tree is only built once a
+ * task number is looked up.
+ */
+
+/**
+ * Build the Fenwick tree over the unfinished tasks of doc in O(n). Node i
+ * (1-based) holds the number of unfinished tasks in lines
+ * [i - lowbit(i), i - 1].
+ */
+static void build_unfinished_tree(struct todo_doc *doc) {
+    int n = doc->num_lines;
+    // Leave room for the lines append_doc_line() can add without growing
+    int size = (doc->line_capacity > n ? doc->line_capacity : n) + 1;
+    int *tree = arena_alloc(&doc->arena, size * sizeof(int));
+    memset(tree, 0, size * sizeof(int));
+
+    for (int i = 1; i <= n; i++) {
+        tree[i] += doc->lines[i - 1].kind == LINE_UNFINISHED;
+        int parent = i + (i & -i);
+        if (parent <= n) {
+            tree[parent] += tree[i];
+        }
+    }
+    doc->unfinished_tree = tree;
+}
+
+/**
+ * Return the line index of the Nth unfinished task (1-based index) of doc,
+ * or -1 if there is no such task.
+ */
+int find_unfinished_line(struct todo_doc *doc, int index) {
+    if (index <= 0 || index > doc->num_unfinished) {
+        return -1;
+    }
+    if (!doc->unfinished_tree) {
+        build_unfinished_tree(doc);
+    }
+
+    // Descend the tree, skipping every subtree with fewer tasks than are left
+    int step = 1;
+    while (step * 2 <= doc->num_lines) {
+        step *= 2;
+    }
+    int pos = 0;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= doc->num_lines && doc->unfinished_tree[pos + step] < index) {
+            pos += step;
+            index -= doc->unfinished_tree[pos];
+        }
+    }
+    return pos;
+}
+
+/**
+ * Change the kind of a line of doc, keeping the task counts and the task
+ * numbering up to date.
+ */
+void set_line_kind(struct todo_doc *doc, int line_index, int kind) {
+    struct todo_line *line = &doc->lines[line_index];
+    int delta = (kind == LINE_UNFINISHED) - (line->kind == LINE_UNFINISHED);
+
+    doc->num_unfinished += delta;
+    doc->num_finished += (kind == LINE_FINISHED) - (line->kind == LINE_FINISHED);
+    if (kind == LINE_DELETED && (doc->num_deleted == 0 || line_index < doc->first_deleted)) {
+        doc->first_deleted = line_index;
+    }
+    doc->num_deleted += (kind == LINE_DELETED) - (line->kind == LINE_DELETED);
+    line->kind = kind;
+
+    if (delta && doc->unfinished_tree) {
+        for (int i = line_index + 1; i <= doc->num_lines; i += i & -i) {
+            doc->unfinished_tree[i] += delta;
+        }
+    }
+}
+
+/**
+ * Count the unfinished tasks in the first count lines of doc with its tree.
+ */
+static int count_unfinished(const struct todo_doc *doc, int count) {
+    int sum = 0;
+    for (int i = count; i > 0; i -= i & -i) {
+        sum += doc->unfinished_tree[i];
+    }
+    return sum;
+}
+
+/**
+ * Return the start of a line of doc, in the loaded buffer or the add buffer.
+ */
+char *line_data(const struct todo_doc *doc, const struct todo_line *line) {
+    if (line->offset < doc->size) {
+        return doc->data + line->offset;
+    }
+    return doc->added + (line->offset - doc->size);
+}
+
+/**
+ * Copy text to the end of doc's add buffer and return its offset in doc.
+ */
+static uint64_t add_doc_text(struct todo_doc *doc, const char *text, size_t length) {
+    if (doc->added_size + length > doc->added_capacity) {
+        size_t capacity = doc->added_capacity ? doc->added_capacity * 2 : 4096;
+        while (capacity < doc->added_size + length) {
+            capacity *= 2;
+        }
+        doc->added = todo_realloc(doc->added, capacity);
+        doc->added_capacity = capacity;
+    }
+
+    memcpy(doc->added + doc->added_size, text, length);
+    doc->added_size += length;
+    return doc->size + doc->added_size - length;
+}
+
+/**
+ * Append a line to doc. The text, which should end with a newline, is copied
+ * to the add buffer, and the task counts and numbering are kept up to date,
+ * all in amortized O(log n).
+ */
+void append_doc_line(struct todo_doc *doc, const char *text, size_t length) {
+    if (length > UINT32_MAX) {
+        fprintf(stderr, "Line %d of %s is too long.\n", doc->num_lines + 1, todos_filename);
+        exit(EXIT_FAILURE);
+    }
+    if (doc->num_lines >= doc->line_capacity) {
+        int new_capacity = doc->num_lines ? doc->num_lines * 2 : 16;
+        doc->lines = arena_grow(&doc->arena, doc->lines, doc->num_lines * sizeof(struct todo_line),
+                                new_capacity * sizeof(struct todo_line));
+        doc->line_capacity = new_capacity;
+        // The tree has no room for the new lines, so it's rebuilt when needed
+        doc->unfinished_tree = NULL;
+    }
+
+    struct todo_line *line = &doc->lines[doc->num_lines];
+    line->offset = 0;
+    line->length = (uint32_t)length;
+    classify_line(text, line);
+    line->offset = add_doc_text(doc, text, length);
+
+    doc->num_lines++;
+    doc->num_unfinished += line->kind == LINE_UNFINISHED;
+    doc->num_finished += line->kind == LINE_FINISHED;
+
+    // The new node covers lines [pos - lowbit(pos), pos - 1], all but the new
+    // one already counted by the tree
+    if (doc->unfinished_tree) {
+        int pos = doc->num_lines;
+        doc->unfinished_tree[pos] = (line->kind == LINE_UNFINISHED) +
+                                    count_unfinished(doc, pos - 1) - count_unfinished(doc, pos - (pos & -pos));
+    }
+}
+
+/**
+ * Extend the line table of doc, which describes the first old_size bytes of
+ * doc->data, to all of doc->data after it has grown by appending. Only the new tail is parsed, plus the old last line if it
+ * had no newline yet. doc must not have unsaved changes.
+ *
+ * @return The index of the first line that was parsed.
+ */
+static int parse_appended(struct todo_doc *doc, size_t old_size) {
+    size_t start = old_size;
+    if (doc->num_lines > 0 && doc->data[old_size - 1] != '\n') {
+        // The old last line has grown, so parse it again
+        doc->num_lines--;
+        start = doc->lines[doc->num_lines].offset;
+    }
+
+    struct todo_doc tail = { .data = doc->data, .size = doc->size };
+    index_lines(&tail, start);
+
+    int first = doc->num_lines;
+    doc->lines = arena_grow(&doc->arena, doc->lines, first * sizeof(struct todo_line),
+                            (first + tail.num_lines) * sizeof(struct todo_line));
+    memcpy(doc->lines + first, tail.lines, tail.num_lines * sizeof(struct todo_line));
+    doc->num_lines += tail.num_lines;
+    doc->unfinished_tree = NULL;
+    count_tasks(doc);
+
+    arena_free(&tail.arena);
+    return first;
+}
+
+/**
+ * Map a todo file into doc and take its identity, without parsing it. The
+ * file is mapped privately, so marking a task done only touches the page it
+ * lives on; where mapping isn't possible it is read in one go.
+ *
+ * @return Whether doc->identity was taken, i.e. the file is a regular file
+ *         with contents.
+ */
+static int map_todo_file(struct todo_doc *doc, const char *filename) {
+    memset(doc, 0, sizeof(*doc));
+
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        // It's not necessarily an error if the file doesn't exist;
+        // we may be creating a new one.
+        return 0;
+    }
+
+    struct stat st;
+    int have_stat = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (have_stat && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            doc->data = map;
+            doc->size = (size_t)st.st_size;
+            doc->mapped = 1;
+        }
+    }
+    close(fd);
+#else
+    struct stat st;
+    int have_stat = stat(filename, &st) == 0;
+#endif
+
+    if (!doc->mapped) {
+        doc->data = read_whole_file(filename, &doc->arena, &doc->size);
+    }
+
+    if (!doc->data || !have_stat) {
+        return 0;
+    }
+
+    doc->identity.device = (uint64_t)st.st_dev;
+    doc->identity.inode = (uint64_t)st.st_ino;
+    doc->identity.size = doc->size;
+    doc->identity.mtime_sec = (int64_t)st.st_mtime;
+    doc->identity.mtime_nsec = (int64_t)ST_MTIME_NSEC(st);
+    doc->identity.hash = content_hash(doc->data, doc->size);
+    return 1;
+}
+
+/**
+ * Load a todo file into doc without copying its contents: see map_todo_file.
+ * The lines are (offset, length) views into the mapping.
+ *
+ * @return The number of lines, 0 if the file doesn't exist or is empty.
+ */
+int load_todo_doc(struct todo_doc *doc, const char *filename) {
+    int have_stat = map_todo_file(doc, filename);
+    if (!doc->data) {
+        return 0;
+    }
+
+    if (use_index && have_stat && read_index(doc, filename)) {
+        return doc->num_lines;
+    }
+
+    parse_lines(doc);
+
+    if (use_index && have_stat) {
+        write_index(doc, filename);
+    }
+    return doc->num_lines;
+}
+
+#define INDEX_MAGIC "TODOIDX4"
+
+/**
+ * The start of an index file. It's followed by the line table of the
+ * document it was written for; the task counts are taken from that, which
+ * is cheap and keeps appending to the index cheap as well.
+ */
+struct index_header {
+    char magic[8];
+    struct file_identity identity;
+    struct full_hash content;
+    int32_t num_lines;
+    int32_t line_size;
+};
+
+/**
+ * Start a full_hash of no bytes.
+ */
+static void full_hash_init(struct full_hash *hash) {
+    for (int lane = 0; lane < FULL_HASH_LANES; lane++) {
+        hash->lanes[lane] = 14695981039346656037ULL + lane;
+    }
+    memset(hash->tail, 0, sizeof(hash->tail));
+}
+
+/**
+ * Carry hash, which covers data[0, from), on to cover data[0, to). The lanes
+ * are independent, so the loop isn't held up by the multiplications.
+ */
+static void full_hash_extend(struct full_hash *hash, const char *data, size_t from, size_t to) {
+    for (size_t block = from / FULL_HASH_BLOCK; block < to / FULL_HASH_BLOCK; block++) {
+        for (int lane = 0; lane < FULL_HASH_LANES; lane++) {
+            uint64_t word;
+            memcpy(&word, data + block * FULL_HASH_BLOCK + lane * 8, 8);
+            uint64_t mixed = (hash->lanes[lane] ^ word) * 0x9e3779b97f4a7c15ULL;
+            hash->lanes[lane] = (mixed << 31) | (mixed >> 33);
+        }
+    }
+    memset(hash->tail, 0, sizeof(hash->tail));
+    memcpy(hash->tail, data + to / FULL_HASH_BLOCK * FULL_HASH_BLOCK, to % FULL_HASH_BLOCK);
+}
+
+/**
+ * Fill doc's tables from the index next to filename, if there is one and it
+ * was written for the file as it is now. If the file has only grown since,
+ * i.e. a full hash of its old size still matches, only the new tail is
+ * parsed and appended to the index.
+ *
+ * @return 1 if the tables were read, 0 if the document has to be parsed.
+ */
+int read_index(struct todo_doc *doc, const char *filename) {
+    char *path = sidecar_path(filename, ".idx");
+    FILE *file = fopen(path, "rb");
+    free(path);
+    if (!file) {
+        return 0;
+    }
+
+    struct index_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, INDEX_MAGIC, 8) != 0) {
+        fclose(file);
+        return 0;
+    }
+
+    // The sampled hash is only a cheap first check before the old part of
+    // the file is read whole; any edit in it means parsing everything again
+    struct full_hash hash;
+    int unchanged = memcmp(&header.identity, &doc->identity, sizeof(struct file_identity)) == 0;
+    int appended = !unchanged && header.identity.size > 0 && header.identity.size < doc->size &&
+                   header.identity.hash == content_hash(doc->data, header.identity.size);
+    if (appended) {
+        full_hash_init(&hash);
+        full_hash_extend(&hash, doc->data, 0, header.identity.size);
+        appended = memcmp(&hash, &header.content, sizeof(hash)) == 0;
+    }
+
+    if ((!unchanged && !appended) ||
+        header.line_size != (int32_t)sizeof(struct todo_line) || header.num_lines < 0) {
+        fclose(file);
+        return 0;
+    }
+
+    doc->num_lines = header.num_lines;
+    doc->lines = arena_alloc(&doc->arena, doc->num_lines * sizeof(struct todo_line));
+    int ok = fread(doc->lines, sizeof(struct todo_line), doc->num_lines, file) == (size_t)doc->num_lines;
+    fclose(file);
+
+    if (!ok) {
+        // A truncated index; start over
+        arena_free(&doc->arena);
+        doc->lines = NULL;
+        doc->num_lines = 0;
+        return 0;
+    }
+
+    if (appended) {
+        int first = parse_appended(doc, header.identity.size);
+        full_hash_extend(&hash, doc->data, header.identity.size, doc->size);
+        append_index(doc, filename, first, &hash);
+    } else {
+        count_tasks(doc);
+    }
+    return 1;
+}
+
+/**
+ * Write the header of an index for doc, whose full hash is given, or an
+ * invalid one.
+ */
+static int write_index_header(const struct todo_doc *doc, const struct full_hash *hash, FILE *file, int valid) {
+    struct index_header header = { .magic = INDEX_MAGIC };
+    if (!valid) {
+        memset(header.magic, 0, sizeof(header.magic));
+    }
+    header.identity = doc->identity;
+    header.content = *hash;
+    header.num_lines = doc->num_lines;
+    header.line_size = sizeof(struct todo_line);
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+/**
+ * Write the index for doc next to filename. The index is written to a
+ * temporary file of its own first, so a reader never sees a partly written
+ * one, even with other commands that only read the file writing it as well.
+ */
+void write_index(const struct todo_doc *doc, const char *filename) {
+    char *path = sidecar_path(filename, ".idx");
+#ifndef _WIN32
+    char *tmp_path = sidecar_path(filename, ".idx.XXXXXX");
+    int fd = mkstemp(tmp_path);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (fd >= 0 && !file) {
+        close(fd);
+        remove(tmp_path);
+    }
+    if (file) {
+        fchmod(fd, default_mode());
+    }
+#else
+    char *tmp_path = sidecar_path(filename, ".idx.tmp");
+    FILE *file = fopen(tmp_path, "wb");
+#endif
+    if (file) {
+        struct full_hash hash;
+        full_hash_init(&hash);
+        full_hash_extend(&hash, doc->data, 0, doc->size);
+        int ok = write_index_header(doc, &hash, file, 1) &&
+                 fwrite(doc->lines, sizeof(struct todo_line), doc->num_lines, file) == (size_t)doc->num_lines;
+        ok = fclose(file) == 0 && ok;
+
+#ifdef _WIN32
+        remove(path);
+#endif
+        if (!ok || rename(tmp_path, path) != 0) {
+            remove(tmp_path);
+        }
+    }
+
+    free(tmp_path);
+    free(path);
+}
+
+/**
+ * Update the index next to filename after lines from first on were parsed by
+ * parse_appended(), writing only those lines and hash, the full hash of the
+ * grown file. The header is invalidated while the lines are written, so an
+ * interrupted update is never trusted.
+ */
+void append_index(const struct todo_doc *doc, const char *filename, int first, const struct full_hash *hash) {
+    char *path = sidecar_path(filename, ".idx");
+    FILE *file = fopen(path, "r+b");
+    free(path);
+    if (!file) {
+        return;
+    }
+
+    size_t count = doc->num_lines - first;
+    if (write_index_header(doc, hash, file, 0) && fflush(file) == 0 &&
+        fseek(file, (long)(sizeof(struct index_header) + first * sizeof(struct todo_line)), SEEK_SET) == 0 &&
+        fwrite(doc->lines + first, sizeof(struct todo_line), count, file) == count &&
+        fflush(file) == 0 && fseek(file, 0, SEEK_SET) == 0) {
+        write_index_header(doc, hash, file, 1);
+    }
+    fclose(file);
+}
+
+/**
+ * Release everything held by doc.
+ */
+void free_todo_doc(struct todo_doc *doc) {
+#ifndef _WIN32
+    if (doc->mapped) {
+        munmap(doc->data, doc->size);
+    }
+#endif
+    free(doc->added);
+    free(doc->patches);
+    free(doc->changes);
+    arena_free(&doc->arena);
+    memset(doc, 0, sizeof(*doc));
+}
+
+/**
+ * Read all lines from the todo file into a NULL-terminated array of strings.
+ * Returns NULL if the file doesn't exist or is empty.
+ *
+ * This copies every line and only exists for callers that want plain strings;
+ * the commands work on the zero-copy todo_doc instead. The strings and the
+ * array are allocated together and released by free_all_lines().
+ */
+char **get_all_lines(void) {
+    FILE *file = fopen(todos_filename, "rb");
+    if (!file) {
+        // It's not necessarily an error if the file doesn't exist;
+        // we may be creating a new one.
+        return NULL;
+    }
+
+    struct line_reader reader;
+    line_reader_open(&reader, file);
+
+    char **lines = NULL;
+    int num_lines = 0;
+    int capacity = 0;
+    const char *line;
+    size_t length;
+
+    while ((line = line_reader_next(&reader, &length))) {
+        // Leave room for the terminating NULL
+        if (num_lines + 1 >= capacity) {
+            int new_capacity = capacity ? capacity * 2 : 1024;
+            lines = arena_grow(&lines_arena, lines, capacity * sizeof(char *), new_capacity * sizeof(char *));
+            capacity = new_capacity;
+        }
+        char *copy = arena_alloc(&lines_arena, length + 1);
+        memcpy(copy, line, length);
+        copy[length] = '\0';
+        lines[num_lines++] = copy;
+    }
+    line_reader_close(&reader);
+    fclose(file);
+
+    if (num_lines == 0) {
+        return NULL;
+    }
+
+    // Null-terminate the array
+    lines[num_lines] = NULL;
+
+    return lines;
+}
+
+/**
+ * Release the lines returned by get_all_lines() in one go.
+ */
+void free_all_lines(void) {
+    arena_free(&lines_arena);
+    todo_lines = NULL;
+}
+
+/**
+ * Return the line numbers of all unfinished tasks (those starting with "- [ ]"),
+ * along with a count of how many there are.
+ *
+ * @param count_out Output parameter for number of unfinished tasks.
+ * @return Pointer to a dynamically allocated int array (line indices).
+ */
+int *get_unfinished_tasks(int *count_out) {
+    int *unfinished_tasks = NULL;
+    int num_unfinished = 0;
+
+    if (!todo_lines) {
+        *count_out = 0;
+        return NULL;
+    }
+
+    for (int i = 0; todo_lines[i]; i++) {
+        char *trimmed_line = skip_leading_whitespace(todo_lines[i]);
+        if (strncmp(trimmed_line, "- [ ]", 5) == 0) {
+            num_unfinished++;
+            unfinished_tasks = todo_realloc(unfinished_tasks, num_unfinished * sizeof(int));
+            unfinished_tasks[num_unfinished - 1] = i;
+        }
+    }
+
+    *count_out = num_unfinished;
+    return unfinished_tasks;
+}
+
+/**
+ * Return the line numbers of all finished tasks (those starting with "- [x]"),
+ * along with a count of how many there are.
+ *
+ * @param count_out Output parameter for number of finished tasks.
+ * @return Pointer to a dynamically allocated int array (line indices).
+ */
+int *get_finished_tasks(int *count_out) {
+    int *finished_tasks = NULL;
+    int num_finished = 0;
+
+    if (!todo_lines) {
+        *count_out = 0;
+        return NULL;
+    }
+
+    for (int i = 0; todo_lines[i]; i++) {
+        char *trimmed_line = skip_leading_whitespace(todo_lines[i]);
+        if (strncmp(trimmed_line, "- [x]", 5) == 0) {
+            num_finished++;
+            finished_tasks = todo_realloc(finished_tasks, num_finished * sizeof(int));
+            finished_tasks[num_finished - 1] = i;
+        }
+    }
+
+    *count_out = num_finished;
+    return finished_tasks;
+}
+
+/**
+ * Delete a line from todo_lines (shift everything up). The line's storage
+ * belongs to the arena and is released by free_all_lines().
+ *
+ * @param line_index Index in todo_lines to delete.
+ */
+void delete_line(int line_index) {
+    // Shift lines down
+    for (int i = line_index; todo_lines[i]; i++) {
+        todo_lines[i] = todo_lines[i + 1];
+    }
+}
+
+/*
+ * Durability. With DURABILITY_FULL every save is synced to disk before it
+ * returns. With DURABILITY_BATCH saves only note what they wrote, and
+ * commit_todos() syncs all of it at once, at the end of a command or every
+ * sync_interval_ms in a process that saves many times: group commit, one
+ * fsync for many saves. DURABILITY_NONE leaves writing back to the system.
+ * An atomic save always syncs, since that is what makes it atomic.
+ */
+static struct {
+    int file;       // The todo file was written since the last commit
+    int journal;    // The journal was written since the last commit
+    int directory;  // One of them was created
+    double since;   // When the first of these writes happened
+} unsynced;
+
+/**
+ * Seconds since some fixed point, for timing.
+ */
+static double seconds_now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Flush the directory entries of the directory filename is in to disk.
+ */
+static void sync_directory(const char *filename) {
+#ifndef _WIN32
+    const char *slash = strrchr(filename, '/');
+    size_t length = slash ? (size_t)(slash - filename) + 1 : 0;
+    char *dir = todo_malloc(length + 2);
+    memcpy(dir, filename, length);
+    strcpy(dir + length, ".");
+
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+#else
+    (void)filename;
+#endif
+}
+
+/**
+ * Sync the file at path to disk, if it exists.
+ */
+static void sync_path(const char *path) {
+    FILE *file = fopen(path, "r+b");
+    if (file) {
+        fsync(fileno(file));
+        fclose(file);
+    }
+}
+
+/**
+ * Make a write to fd, the todo file or (journal set) its journal, durable as
+ * durability asks: sync it right away, or note it for commit_todos(). Set
+ * created if the write created the file, so its directory entry is synced
+ * as well.
+ *
+ * @return 1 if successful, 0 if syncing failed.
+ */
+static int sync_written(int fd, int journal, int created) {
+    if (durability == DURABILITY_FULL) {
+        int ok = fsync(fd) == 0;
+        if (created) {
+            sync_directory(todos_filename);
+        }
+        return ok;
+    }
+
+    if (durability == DURABILITY_BATCH) {
+        if (!unsynced.file && !unsynced.journal) {
+            unsynced.since = seconds_now();
+        }
+        if (journal) {
+            unsynced.journal = 1;
+        } else {
+            unsynced.file = 1;
+        }
+        unsynced.directory |= created;
+    }
+    return 1;
+}
+
+/**
+ * Sync everything saved since the last commit to disk (DURABILITY_BATCH).
+ */
+void commit_todos(void) {
+    if (unsynced.file) {
+        sync_path(todos_filename);
+    }
+    if (unsynced.journal) {
+        char *path = sidecar_path(todos_filename, ".journal");
+        sync_path(path);
+        free(path);
+    }
+    if (unsynced.directory) {
+        sync_directory(todos_filename);
+    }
+    memset(&unsynced, 0, sizeof(unsynced));
+}
+
+/**
+ * Return whether there are saves that commit_todos() still has to sync.
+ */
+int todos_unsynced(void) {
+    return unsynced.file || unsynced.journal;
+}
+
+/**
+ * Commit if the first save since the last commit is sync_interval_ms old.
+ * For processes that save many times.
+ */
+void commit_todos_if_due(void) {
+    if (todos_unsynced() && seconds_now() - unsynced.since >= sync_interval_ms / 1000.0) {
+        commit_todos();
+    }
+}
+
+/*
+ * Locking. A command locks a file next to the todo file (.todo.lock for
+ * todo.md), shared to list the tasks and exclusive to change them, so
+ * commands running at the same time never lose each other's edits. The lock
+ * file is never replaced, unlike the todo file by an atomic save. Open file
+ * description locks are used where there are any and flock() elsewhere;
+ * either way the lock goes when the process exits. A lock that is taken is
+ * retried with growing pauses, for up to lock_timeout_ms.
+ */
+static int lock_fd = -1;
+
+/**
+ * Try to lock fd without waiting.
+ *
+ * @return 1 if locked, 0 if not, with errno set.
+ */
+static int try_lock(int fd, int exclusive) {
+#ifdef F_OFD_SETLK
+    struct flock lock = { .l_type = exclusive ? F_WRLCK : F_RDLCK, .l_whence = SEEK_SET };
+    return fcntl(fd, F_OFD_SETLK, &lock) == 0;
+#else
+    return flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == 0;
+#endif
+}
+
+/**
+ * Lock todos_filename for this command, waiting for at most lock_timeout_ms.
+ * Where locks can't be had at all, e.g. a read-only directory or a file
+ * system without locks, the command goes ahead without. Only reading a file
+ * that doesn't exist needs no lock, so that it leaves no lock file behind.
+ *
+ * @param exclusive 1 to change the file, 0 to only read it.
+ * @return 1 if locked or going ahead without, 0 if it timed out.
+ */
+int lock_todos(int exclusive) {
+#ifndef _WIN32
+    struct stat st;
+    if (!exclusive && stat(todos_filename, &st) != 0 && errno == ENOENT) {
+        return 1;
+    }
+
+    char *path = sidecar_path(todos_filename, ".lock");
+    lock_fd = open(path, O_RDWR | O_CREAT, 0666);
+    free(path);
+    if (lock_fd < 0) {
+        return 1;
+    }
+
+    double deadline = seconds_now() + lock_timeout_ms / 1000.0;
+    long pause_ns = 100000;
+    while (!try_lock(lock_fd, exclusive)) {
+        if (errno != EAGAIN && errno != EACCES && errno != EWOULDBLOCK && errno != EINTR) {
+            return 1;
+        }
+        if (seconds_now() >= deadline) {
+            printf("Timed out waiting for another command to finish with %s.\n", todos_filename);
+            unlock_todos();
+            return 0;
+        }
+        struct timespec pause = { 0, pause_ns };
+        nanosleep(&pause, NULL);
+        pause_ns = pause_ns < 10000000 ? pause_ns * 2 : 20000000;
+    }
+#else
+    (void)exclusive;
+#endif
+    return 1;
+}
+
+/**
+ * Release the lock taken by lock_todos(), if any.
+ */
+void unlock_todos(void) {
+#ifndef _WIN32
+    if (lock_fd >= 0) {
+        close(lock_fd);
+        lock_fd = -1;
+    }
+#endif
+}
+
+/*
+ * The journal. With --journal, edits aren't saved to the todo file but
+ * appended as records to a journal next to it (.todo.journal for todo.md),
+ * and every command replays the journal over the file. The journal starts
+ * with a header naming the version of the file it was started on:
+ *
+ *   todo-journal <size> <hash>
+ *
+ * followed by one record per edit. A task that was checked or removed is
+ * named by the text of its line, like a doc_change, and found again by
+ * find_changed_line(); the line index is where to look first. On the version
+ * the journal was started on that's always the line itself, while a file that
+ * was changed meanwhile still gets the edits whose tasks it has:
+ *
+ *   c <line> <length> <text>  Check the task on the line with the text
+ *   r <line> <length> <text>  Remove the task on the line with the text
+ *   x                         Remove all finished tasks
+ *   a <length> <text>         Add a task with the text
+ *
+ * Compacting folds the journal back into the file and deletes it.
+ */
+static struct {
+    char *pending;  // Records of the edits since loading
+    size_t size;
+    size_t capacity;
+    int recording;  // Whether edits are recorded
+    int replayed;   // Whether a journal was replayed over todo_doc
+    int foreign;    // Whether there is a file that isn't a journal in its place
+    size_t length;  // Size of the journal file as last read or written
+} journal;
+
+/**
+ * Add a record to the pending journal records, if edits are recorded.
+ */
+static void record_edit(const char *format, ...) {
+    if (!journal.recording) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    size_t length = (size_t)vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (journal.size + length + 1 > journal.capacity) {
+        journal.capacity = (journal.size + length + 1) * 2;
+        journal.pending = todo_realloc(journal.pending, journal.capacity);
+    }
+    va_start(args, format);
+    vsnprintf(journal.pending + journal.size, length + 1, format, args);
+    va_end(args);
+    journal.size += length;
+}
+
+/**
+ * Add an edit to the changes of todo_doc, with a copy of its text: the
+ * mapping may show what another process writes to the file.
+ */
+static void record_change(char op, int line, const char *text, size_t length, size_t task) {
+    if (todo_doc.num_changes == todo_doc.change_capacity) {
+        todo_doc.change_capacity = todo_doc.change_capacity ? todo_doc.change_capacity * 2 : 16;
+        todo_doc.changes = todo_realloc(todo_doc.changes, todo_doc.change_capacity * sizeof(struct doc_change));
+    }
+    char *copy = arena_alloc(&todo_doc.arena, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    todo_doc.changes[todo_doc.num_changes++] = (struct doc_change){ op, line, copy, length, task };
+}
+
+/**
+ * Drop all finished tasks, and any lines removed before, from the line table
+ * of todo_doc in a single sweep that moves every line that stays down to the
+ * next free entry once. Saving finds the gaps from the line offsets.
+ */
+static void remove_finished_lines(void) {
+    int kept = 0;
+    for (int i = 0; i < todo_doc.num_lines; i++) {
+        int kind = todo_doc.lines[i].kind;
+        if (kind != LINE_FINISHED && kind != LINE_DELETED) {
+            todo_doc.lines[kept++] = todo_doc.lines[i];
+            continue;
+        }
+        if (todo_doc.num_deleted == 0 || kept < todo_doc.first_deleted) {
+            todo_doc.first_deleted = kept;
+        }
+        todo_doc.num_deleted += kind == LINE_FINISHED;
+    }
+
+    todo_doc.num_lines = kept;
+    todo_doc.num_finished = 0;
+    // Lines moved, so the tree is rebuilt when it's needed again
+    todo_doc.unfinished_tree = NULL;
+    record_change('x', 0, "", 0, 0);
+}
+
+/**
+ * Remove all finished tasks from todo_doc.
+ */
+void remove_finished_tasks(void) {
+    if (todo_doc.num_finished == 0) {
+        printf("No finished tasks found.\n");
+        return;
+    }
+
+    remove_finished_lines();
+    record_edit("x\n");
+}
+
+/**
+ * Look up the line index of the Nth unfinished task (1-based index). Prints a
+ * message and returns -1 if there is no such task.
+ */
+static int find_unfinished_task(int index) {
+    if (index <= 0) {
+        printf("Invalid index: %d\n", index);
+        return -1;
+    }
+
+    int count = todo_doc.num_unfinished;
+    if (count == 0) {
+        printf("No unfinished tasks found.\n");
+        return -1;
+    }
+
+    if (index > count) {
+        printf("Invalid index: %d (only %d unfinished tasks)\n", index, count);
+        return -1;
+    }
+
+    return find_unfinished_line(&todo_doc, index);
+}
+
+/**
+ * Mark the unfinished task in a line of todo_doc as finished (LINE_FINISHED)
+ * or removed (LINE_DELETED). The line is left alone, with a message, if its
+ * bytes don't hold an unfinished task after all, which would mean that the
+ * line table doesn't belong to the data.
+ */
+static void update_task_line(int line_index, int kind) {
+    // Keep the task's text, without the newline, to find it again on a conflict
+    const struct todo_line *task = &todo_doc.lines[line_index];
+    const char *text = line_data(&todo_doc, task);
+    if (task->length < task->indent + 5u || memcmp(text + task->indent, "- [ ]", 5) != 0) {
+        printf("Line %d isn't an unfinished task any more; leaving it as it is.\n", line_index + 1);
+        return;
+    }
+    size_t length = task->length;
+    while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r')) {
+        length--;
+    }
+    char op = kind == LINE_FINISHED ? 'c' : 'r';
+    record_change(op, line_index, text, length, task->indent + task->text);
+    record_edit("%c %d %zu %.*s\n", op, line_index, length, (int)length, text);
+
+    if (kind == LINE_FINISHED) {
+        // Overwrite the space in "- [ ]" in place; with a private mapping
+        // this only copies the page the task lives on. The offset is kept so
+        // that saving can write just this byte, unless the line was added
+        // and gets written whole anyway.
+        struct todo_line *line = &todo_doc.lines[line_index];
+        line_data(&todo_doc, line)[line->indent + 3] = 'x';
+
+        size_t offset = line->offset + line->indent + 3;
+        if (offset < todo_doc.size) {
+            if (todo_doc.num_patches == todo_doc.patch_capacity) {
+                todo_doc.patch_capacity = todo_doc.patch_capacity ? todo_doc.patch_capacity * 2 : 16;
+                todo_doc.patches = todo_realloc(todo_doc.patches, todo_doc.patch_capacity * sizeof(size_t));
+            }
+            todo_doc.patches[todo_doc.num_patches++] = offset;
+        }
+    }
+    set_line_kind(&todo_doc, line_index, kind);
+}
+
+/**
+ * Remove the Nth unfinished task (1-based index).
+ */
+void remove_task(int index) {
+    int line_index = find_unfinished_task(index);
+    if (line_index >= 0) {
+        update_task_line(line_index, LINE_DELETED);
+    }
+}
+
+/**
+ * Check (mark done) the Nth unfinished task, i.e., the line that begins with "- [ ]".
+ *
+ * @param index The 1-based index of the unfinished task to mark as finished.
+ */
+void check_todo(int index) {
+    int line_index = find_unfinished_task(index);
+    if (line_index >= 0) {
+        update_task_line(line_index, LINE_FINISHED);
+    }
+}
+
+/**
+ * Print the unfinished task in a line of todo_doc as "<number>) <text>".
+ */
+static void print_task(int number, const struct todo_line *line) {
+    const char *text = line_data(&todo_doc, line) + line->indent + line->text;
+    printf("%d) ", number);
+    fwrite(text, 1, line->length - line->indent - line->text, stdout);
+}
+
+/**
+ * Print the unfinished tasks of todo_doc after the first one up to end, which
+ * has to be loaded, numbered on from base.
+ */
+static void print_tasks(int first, int end, int base) {
+    int line_index = find_unfinished_line(&todo_doc, first + 1);
+    for (int number = first + 1; number <= end; line_index++) {
+        if (todo_doc.lines[line_index].kind == LINE_UNFINISHED) {
+            print_task(base + number++, &todo_doc.lines[line_index]);
+        }
+    }
+}
+
+/**
+ * List all unfinished tasks (lines beginning with "- [ ]") from todo_doc
+ * with their 1-based indices.
+ */
+void list_todos(void) {
+    list_todos_window(0, -1);
+}
+
+/**
+ * List at most limit unfinished tasks after skipping the first offset ones,
+ * numbered as in the full listing. A negative limit means no limit.
+ *
+ * If todo_doc is loaded (e.g. from an index) the tasks come from its tables.
+ * Otherwise the file is read block by block, and reading stops as soon as
+ * the last task is printed.
+ */
+void list_todos_window(int offset, int limit) {
+    if (todo_doc.data || todo_doc.added_size) {
+        int end = limit >= 0 && limit < todo_doc.num_unfinished - offset ? offset + limit : todo_doc.num_unfinished;
+        if (offset >= end) {
+            if (limit != 0) {
+                printf("No unfinished tasks found.\n");
+            }
+            return;
+        }
+
+        print_tasks(offset, end, 0);
+        return;
+    }
+
+    FILE *file = fopen(todos_filename, "rb");
+    if (!file) {
+        printf("No unfinished tasks found.\n");
+        return;
+    }
+
+    struct line_reader reader;
+    line_reader_open(&reader, file);
+
+    int count = 0;
+    int printed = 0;
+    const char *data;
+    size_t length;
+
+    while (printed != limit && (data = line_reader_next(&reader, &length))) {
+        struct todo_line line = { .offset = 0, .length = (uint32_t)length };
+        classify_line(data, &line);
+        if (line.kind != LINE_UNFINISHED || ++count <= offset) {
+            continue;
+        }
+
+        // Print as "1) something"
+        printf("%d) ", count);
+        fwrite(data + line.indent + line.text, 1, line.length - line.indent - line.text, stdout);
+        printed++;
+    }
+
+    line_reader_close(&reader);
+    fclose(file);
+
+    if (printed == 0 && limit != 0) {
+        printf("No unfinished tasks found.\n");
+    }
+}
+
+/**
+ * Append a new task in Markdown format ("- [ ] <task>") to todo_doc.
+ * 
+ * If the last line in the file has no newline at the end, adds a newline before the new task.
+ *
+ * @param task The text of the task to add.
+ */
+void add_todo(const char *task) {
+    // Give the last line its newline by moving it to the add buffer
+    if (todo_doc.num_lines > 0) {
+        struct todo_line *last = &todo_doc.lines[todo_doc.num_lines - 1];
+        const char *data = line_data(&todo_doc, last);
+        if (last->length > 0 && data[last->length - 1] != '\n') {
+            uint64_t offset = add_doc_text(&todo_doc, data, last->length);
+            add_doc_text(&todo_doc, "\n", 1);
+            last->offset = offset;
+            last->length++;
+        }
+    }
+
+    size_t length = strlen(task) + 7;
+    char *line = todo_malloc(length + 1);
+    snprintf(line, length + 1, "- [ ] %s\n", task);
+    append_doc_line(&todo_doc, line, length);
+    free(line);
+    record_change('a', todo_doc.num_lines - 1, task, strlen(task), 0);
+    record_edit("a %zu %s\n", strlen(task), task);
+}
+
+/**
+ * Find the line of todo_doc with the unfinished task a check or remove was
+ * made on: the one with the same text nearest to where it was.
+ *
+ * @return The line index, or -1 if no unfinished task has that text.
+ */
+static int find_changed_line(const struct doc_change *change) {
+    int start = change->line < todo_doc.num_lines ? change->line : todo_doc.num_lines - 1;
+    for (int distance = 0; start - distance >= 0 || start + distance < todo_doc.num_lines; distance++) {
+        int candidates[2] = { start - distance, start + distance };
+        for (int j = 0; j < (distance > 0 ? 2 : 1); j++) {
+            int i = candidates[j];
+            if (i < 0 || i >= todo_doc.num_lines || todo_doc.lines[i].kind != LINE_UNFINISHED) {
+                continue;
+            }
+            const struct todo_line *line = &todo_doc.lines[i];
+            const char *text = line_data(&todo_doc, line);
+            if (line->length >= change->length && memcmp(text, change->text, change->length) == 0 &&
+                strspn(text + change->length, "\r\n") >= line->length - change->length) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Make an edit, given as a doc_change, on todo_doc. A task that was checked
+ * or removed is looked up by its text, and is skipped with a message if it's
+ * gone.
+ */
+static void apply_change(const struct doc_change *change) {
+    if (change->op == 'a') {
+        add_todo(change->text);
+    } else if (change->op == 'x') {
+        remove_finished_lines();
+    } else {
+        int line_index = find_changed_line(change);
+        if (line_index >= 0) {
+            update_task_line(line_index, change->op == 'c' ? LINE_FINISHED : LINE_DELETED);
+        } else {
+            printf("\"%s\" changed in %s meanwhile, so it wasn't %s.\n", change->text + change->task,
+                   todos_filename, change->op == 'c' ? "checked" : "removed");
+        }
+    }
+}
+
+/**
+ * Apply the journal records in [pos, end) to todo_doc. A record cut short at
+ * the end, by an append that didn't finish, is ignored.
+ *
+ * @return The number of records applied, or -1 if a record is invalid.
+ */
+static int apply_records(const char *pos, const char *end) {
+    int count = 0;
+    while (pos < end) {
+        const char *newline = memchr(pos, '\n', end - pos);
+        if (!newline) {
+            return count;
+        }
+
+        char *next = (char *)pos + 2;
+        if (pos[0] == 'x' && newline == pos + 1) {
+            remove_finished_lines();
+        } else if ((pos[0] == 'c' || pos[0] == 'r' || pos[0] == 'a') && pos[1] == ' ') {
+            struct doc_change change = { .op = pos[0] };
+            if (pos[0] != 'a') {
+                long line_index = strtol(pos + 2, &next, 10);
+                if (next == pos + 2 || *next != ' ' || line_index < 0 || line_index > INT_MAX) {
+                    return -1;
+                }
+                change.line = (int)line_index;
+                next++;
+            }
+
+            const char *number = next;
+            unsigned long long length = strtoull(number, &next, 10);
+            if (next == number || *next != ' ') {
+                return -1;
+            }
+            const char *text = next + 1;
+            if ((unsigned long long)(end - text) <= length) {
+                return count;
+            }
+            if (text[length] != '\n') {
+                return -1;
+            }
+
+            // A checked or removed line has to be an unfinished task
+            struct todo_line line = { .offset = 0, .length = (uint32_t)length };
+            classify_line(text, &line);
+            if (pos[0] != 'a' && (length > UINT32_MAX || line.kind != LINE_UNFINISHED)) {
+                return -1;
+            }
+            char *copy = todo_malloc(length + 1);
+            memcpy(copy, text, length);
+            copy[length] = '\0';
+            change.text = copy;
+            change.length = length;
+            change.task = line.indent + line.text;
+            apply_change(&change);
+            free(copy);
+            newline = text + length;
+        } else {
+            return -1;
+        }
+
+        pos = newline + 1;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Return whether todos_filename has a journal.
+ */
+int has_journal(void) {
+    char *path = sidecar_path(todos_filename, ".journal");
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+    free(path);
+    return exists;
+}
+
+/**
+ * Return whether the journal of todos_filename was written, created or
+ * deleted by another process since it was last read or written here.
+ */
+int journal_changed(void) {
+    char *path = sidecar_path(todos_filename, ".journal");
+    struct stat st;
+    size_t length = stat(path, &st) == 0 ? (size_t)st.st_size : 0;
+    free(path);
+    return length != journal.length;
+}
+
+/**
+ * Replay the journal of todos_filename, if there is one, over todo_doc. If
+ * the file was changed since the journal was started, the tasks are found by
+ * their text. A file that isn't a journal is ignored with a warning and left
+ * alone; edits are saved to the todo file instead. From here on, edits are
+ * recorded for the journal if use_journal is set.
+ *
+ * @return The number of records replayed.
+ */
+int replay_journal(void) {
+    char *path = sidecar_path(todos_filename, ".journal");
+    struct arena arena = { 0 };
+    size_t size = 0;
+    char *data = read_whole_file(path, &arena, &size);
+    int count = 0;
+
+    // Replayed edits are in the journal already
+    journal.recording = 0;
+    journal.replayed = 0;
+    journal.foreign = 0;
+    journal.length = data ? size : 0;
+    if (data) {
+        // read_whole_file() always leaves room after the data
+        data[size] = '\0';
+        char *next;
+        char *newline = memchr(data, '\n', size);
+        int valid = newline && strncmp(data, "todo-journal ", 13) == 0;
+        if (valid) {
+            strtoull(data + 13, &next, 10);
+            strtoull(next, &next, 10);
+            valid = next == newline;
+        }
+
+        if (valid) {
+            journal.replayed = 1;
+            count = apply_records(newline + 1, data + size);
+            if (count < 0) {
+                printf("Stopped replaying %s at an invalid record.\n", path);
+            }
+        } else {
+            journal.foreign = 1;
+            printf("Ignoring %s, it isn't a journal; edits are saved to %s directly.\n", path, todos_filename);
+        }
+    }
+
+    arena_free(&arena);
+    free(path);
+    journal.recording = use_journal;
+    return count;
+}
+
+/**
+ * Append the records of the edits since loading to the journal, starting a
+ * new journal if none was replayed. A file that isn't a journal is never
+ * replaced.
+ *
+ * @return The size of the journal afterwards, or 0 if it couldn't be written.
+ */
+static size_t append_journal(void) {
+    if (journal.foreign) {
+        return 0;
+    }
+
+    char *path = sidecar_path(todos_filename, ".journal");
+    FILE *file = fopen(path, journal.replayed ? "ab" : "wb");
+    long size = 0;
+
+    if (file) {
+        int ok = journal.replayed ||
+                 fprintf(file, "todo-journal %llu %llu\n", (unsigned long long)todo_doc.identity.size,
+                         (unsigned long long)todo_doc.identity.hash) > 0;
+        ok = ok && fwrite(journal.pending, 1, journal.size, file) == journal.size;
+        size = ftell(file);
+        ok = ok && fflush(file) == 0 && sync_written(fileno(file), 1, !journal.replayed);
+        ok = fclose(file) == 0 && ok;
+        if (!ok) {
+            size = 0;
+        }
+    }
+
+    if (size > 0) {
+        journal.replayed = 1;
+        journal.size = 0;
+        journal.length = (size_t)size;
+    } else {
+        printf("Error writing %s.\n", path);
+    }
+    free(path);
+    return size > 0 ? (size_t)size : 0;
+}
+
+/**
+ * Write count buffers to fd in order, retrying short writes. Where it's
+ * available, each batch of buffers takes a single writev().
+ *
+ * @return 1 if successful, 0 if there was an error.
+ */
+static int write_buffers(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+#ifdef _WIN32
+        long n = _write(fd, iov->iov_base, (unsigned)iov->iov_len);
+#else
+        ssize_t n = writev(fd, iov, count);
+#endif
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        for (; count > 0 && (size_t)n >= iov->iov_len; iov++, count--) {
+            n -= iov->iov_len;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Writes pieces of todo_doc to a file in order. Pieces are collected and
+ * written in batches, except for large unchanged ranges of the loaded file,
+ * which the kernel copies straight from it where it can.
+ */
+struct piece_writer {
+    int fd;
+    int src_fd;  // The loaded file, or -1 to write everything from memory
+    struct iovec pieces[SAVE_BATCH_SIZE];
+    int num_pieces;
+    char *bounce;  // If set, pieces are copied here first, see save_in_place()
+    size_t bounced;
+    size_t written;
+    int ok;
+};
+
+static void flush_pieces(struct piece_writer *writer) {
+    if (writer->bounced > 0) {
+        writer->pieces[0].iov_base = writer->bounce;
+        writer->pieces[0].iov_len = writer->bounced;
+        writer->num_pieces = 1;
+        writer->bounced = 0;
+    }
+    if (writer->num_pieces > 0 && writer->ok) {
+        writer->ok = write_buffers(writer->fd, writer->pieces, writer->num_pieces);
+    }
+    writer->num_pieces = 0;
+}
+
+static void write_piece(struct piece_writer *writer, const char *data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (writer->bounce) {
+        while (length > 0) {
+            if (writer->bounced == SAVE_BOUNCE_SIZE) {
+                flush_pieces(writer);
+            }
+            size_t n = SAVE_BOUNCE_SIZE - writer->bounced < length ? SAVE_BOUNCE_SIZE - writer->bounced : length;
+            memcpy(writer->bounce + writer->bounced, data, n);
+            writer->bounced += n;
+            writer->written += n;
+            data += n;
+            length -= n;
+        }
+        return;
+    }
+    if (writer->num_pieces == SAVE_BATCH_SIZE) {
+        flush_pieces(writer);
+    }
+    writer->pieces[writer->num_pieces].iov_base = (void *)data;
+    writer->pieces[writer->num_pieces].iov_len = length;
+    writer->num_pieces++;
+    writer->written += length;
+}
+
+/**
+ * Write the range [start, end) of the loaded buffer, which has no changed
+ * bytes. A large range is copied from the loaded file with copy_file_range(),
+ * so it never passes through user space; where that isn't supported the
+ * range is written from memory like any other piece.
+ */
+static void copy_piece(struct piece_writer *writer, size_t start, size_t end) {
+#ifdef __linux__
+    if (writer->src_fd >= 0 && end - start >= COPY_RANGE_MIN) {
+        flush_pieces(writer);
+        off_t from = (off_t)start;
+        while (writer->ok && (size_t)from < end) {
+            ssize_t n = copy_file_range(writer->src_fd, &from, writer->fd, NULL, end - from, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                // Not supported for these files, or the file shrank
+                writer->src_fd = -1;
+                break;
+            }
+            writer->written += n;
+        }
+        start = (size_t)from;
+    }
+#endif
+    write_piece(writer, todo_doc.data + start, end - start);
+}
+
+static int compare_size(const void *a, const void *b) {
+    size_t as = *(const size_t *)a;
+    size_t bs = *(const size_t *)b;
+    return (as > bs) - (as < bs);
+}
+
+/**
+ * Write the lines of todo_doc from line first on, without the removed ones.
+ * Lines are contiguous in their buffer, so each run of lines between removed
+ * ones is a single piece; the bytes changed by check split the runs of
+ * loaded lines so the rest of them can be copied.
+ */
+static void write_lines(struct piece_writer *writer, int first) {
+    if (todo_doc.num_patches > 1) {
+        qsort(todo_doc.patches, todo_doc.num_patches, sizeof(size_t), compare_size);
+    }
+    int patch = 0;
+
+    for (int i = first; i < todo_doc.num_lines;) {
+        if (todo_doc.lines[i].kind == LINE_DELETED) {
+            i++;
+            continue;
+        }
+        const struct todo_line *line = &todo_doc.lines[i];
+        size_t start = line->offset;
+        size_t end = start;
+        int loaded = start < todo_doc.size;
+        for (; i < todo_doc.num_lines && todo_doc.lines[i].kind != LINE_DELETED &&
+               todo_doc.lines[i].offset == end && (end < todo_doc.size) == loaded; i++) {
+            end += todo_doc.lines[i].length;
+        }
+
+        if (!loaded) {
+            write_piece(writer, line_data(&todo_doc, line), end - start);
+            continue;
+        }
+        while (patch < todo_doc.num_patches && todo_doc.patches[patch] < start) {
+            patch++;
+        }
+        for (; patch < todo_doc.num_patches && todo_doc.patches[patch] < end; patch++) {
+            size_t offset = todo_doc.patches[patch];
+            copy_piece(writer, start, offset);
+            write_piece(writer, todo_doc.data + offset, 1);
+            start = offset + 1;
+        }
+        copy_piece(writer, start, end);
+    }
+
+    flush_pieces(writer);
+}
+
+#ifndef _WIN32
+/**
+ * Save todo_doc into the file in place, rewriting only what changed: the
+ * bytes changed by check are written one by one, and only the part of the
+ * file from the first removed or added line on is rewritten, after which the
+ * file is truncated. Every line is written at or before the offset it was
+ * read from, so lines that are still to be written are never overwritten,
+ * even if they are read from a mapping of this very file. The pages of such
+ * a mapping are the file's, though, and the kernel makes no promise about
+ * writing a range of a file from an overlapping one, so those lines are
+ * copied through a buffer and every write ends before what is read next.
+ */
+static int save_in_place(void) {
+    int fd = open(todos_filename, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0) {
+        printf("Error opening %s for writing.\n", todos_filename);
+        return 0;
+    }
+
+    // Added lines follow the loaded ones, in the order of the add buffer
+    int first = todo_doc.num_lines;
+    while (first > 0 && todo_doc.lines[first - 1].offset >= todo_doc.size) {
+        first--;
+    }
+    if (todo_doc.num_deleted > 0 && todo_doc.first_deleted < first) {
+        first = todo_doc.first_deleted;
+    }
+    const struct todo_line *prev = first > 0 ? &todo_doc.lines[first - 1] : NULL;
+    size_t at = prev ? prev->offset + prev->length : 0;
+
+    int ok = 1;
+    for (int i = 0; i < todo_doc.num_patches && ok; i++) {
+        size_t offset = todo_doc.patches[i];
+        if (offset < at && pwrite(fd, todo_doc.data + offset, 1, (off_t)offset) != 1) {
+            perror("pwrite");
+            ok = 0;
+        }
+    }
+
+    if (ok && (first < todo_doc.num_lines || todo_doc.num_deleted > 0)) {
+        struct piece_writer writer = { .fd = fd, .src_fd = -1, .ok = 1 };
+        if (todo_doc.mapped) {
+            writer.bounce = todo_malloc(SAVE_BOUNCE_SIZE);
+        }
+        if (lseek(fd, (off_t)at, SEEK_SET) < 0) {
+            writer.ok = 0;
+        } else {
+            write_lines(&writer, first);
+        }
+        free(writer.bounce);
+        ok = writer.ok && ftruncate(fd, (off_t)(at + writer.written)) == 0;
+        if (!ok) {
+            perror("write");
+        }
+    }
+    todo_doc.num_patches = 0;
+
+    ok = ok && sync_written(fd, 0, !todo_doc.data);
+    return close(fd) == 0 && ok;
+}
+
+/**
+ * Replace the todo file with what write() writes, through a temporary file
+ * in the same directory, which is synced to disk and then renamed over the
+ * todo file. Whatever happens in between, even a crash or a full disk, the
+ * todo file is either the old or the new one, never a partial write. If the
+ * todo file is a symlink, the file it points to is replaced.
+ *
+ * @param write Writes the new contents; todo_doc is the file being replaced.
+ * @return 1 if successful, 0 if there was an error.
+ */
+static int replace_file(void (*write)(struct piece_writer *writer)) {
+    char *target = realpath(todos_filename, NULL);
+    const char *path = target ? target : todos_filename;
+    char *tmp_path = sidecar_path(path, ".save.XXXXXX");
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        printf("Error opening %s for writing.\n", tmp_path);
+        free(tmp_path);
+        free(target);
+        return 0;
+    }
+
+    // Keep the permissions of the file being replaced, or give a new one
+    // those it would get without the temporary file
+    struct stat st;
+    fchmod(fd, stat(path, &st) == 0 ? st.st_mode & 07777 : default_mode());
+    int src_fd = todo_doc.data ? open(path, O_RDONLY) : -1;
+
+    struct piece_writer writer = { .fd = fd, .src_fd = src_fd, .ok = 1 };
+    write(&writer);
+    int ok = writer.ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (src_fd >= 0) {
+        close(src_fd);
+    }
+
+    ok = ok && rename(tmp_path, path) == 0;
+    if (ok) {
+        sync_directory(path);
+    } else {
+        printf("Error saving %s, it was left unchanged.\n", todos_filename);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    free(target);
+    return ok;
+}
+#else
+/**
+ * Overwrite the todo file with what write() writes. The document was read
+ * into memory, so nothing is read from the file while it's written.
+ */
+static int replace_file(void (*write)(struct piece_writer *writer)) {
+    FILE *file = fopen(todos_filename, "wb");
+    if (!file) {
+        printf("Error opening %s for writing.\n", todos_filename);
+        return 0;
+    }
+
+    struct piece_writer writer = { .fd = fileno(file), .src_fd = -1, .ok = 1 };
+    write(&writer);
+    if (!writer.ok) {
+        perror("write");
+    }
+    int ok = writer.ok && sync_written(fileno(file), 0, !todo_doc.data);
+    return fclose(file) == 0 && ok;
+}
+#endif
+
+static void write_all_lines(struct piece_writer *writer) {
+    write_lines(writer, 0);
+}
+
+/*
+ * Undo log. Every save of the todo file adds an entry to a log next to it
+ * (.todo.undo for todo.md) holding the inverse of what the save did, as
+ * hunks: an offset into the file as it was, the bytes that were there and
+ * the bytes that replaced them. Undo writes the old bytes back and redo the
+ * new ones, copying the ranges in between, so neither parses or diffs the
+ * file. Each entry records the size and hash of the file before and after
+ * the save, and the log the whole identity of the file as the last save, undo
+ * or redo left it, so a file that was changed some other way since is left
+ * alone. Saving a file that the log doesn't know starts a new log, as the
+ * older entries can't be undone past the other change. Only the last
+ * UNDO_DEPTH saves are kept.
+ */
+
+#define UNDO_MAGIC "TODOUND2"
+
+struct undo_header {
+    char magic[8];
+    int32_t position;                 // Entries before this one are applied
+    int32_t count;
+    uint64_t offsets[UNDO_DEPTH + 1]; // Where each entry starts, then the end
+    struct file_identity file;        // The todo file as the log left it
+};
+
+struct undo_entry {
+    uint64_t size_before, hash_before;
+    uint64_t size_after, hash_after;
+    uint32_t num_hunks;
+    uint32_t reserved;
+};
+
+/** A hunk of an undo entry, followed by its old and then its new bytes. */
+struct undo_hunk {
+    uint64_t offset;
+    uint64_t old_length;
+    uint64_t new_length;
+};
+
+/** The entry being undone or redone, for write_undo_hunks(). */
+static struct {
+    const struct undo_entry *entry;
+    int redo;
+} undoing;
+
+/**
+ * Append the header of a hunk to entry and make room for its bytes.
+ *
+ * @return Where the old bytes go, followed by the new ones.
+ */
+static char *add_undo_hunk(char **entry, size_t *size, size_t offset, size_t old_length,
+                           size_t new_length) {
+    struct undo_hunk hunk = { offset, old_length, new_length };
+    *entry = todo_realloc(*entry, *size + sizeof(hunk) + old_length + new_length);
+    memcpy(*entry + *size, &hunk, sizeof(hunk));
+    *size += sizeof(hunk) + old_length + new_length;
+    return *entry + *size - old_length - new_length;
+}
+
+/**
+ * Copy the range [start, end) of the loaded file as it was loaded: with the
+ * bytes changed by check put back. patch is the first patch not before start
+ * and is advanced past end.
+ */
+static void copy_loaded_bytes(char *out, size_t start, size_t end, int *patch) {
+    memcpy(out, todo_doc.data + start, end - start);
+    for (; *patch < todo_doc.num_patches && todo_doc.patches[*patch] < end; (*patch)++) {
+        out[todo_doc.patches[*patch] - start] = ' ';
+    }
+}
+
+/**
+ * Describe the unsaved changes to todo_doc as hunks appended to entry, which
+ * starts with a struct undo_entry: the ranges of the loaded file taken by
+ * removed lines, the boxes ticked by check, and the lines added at the end.
+ *
+ * @return The number of hunks.
+ */
+static uint32_t collect_undo_hunks(char **entry, size_t *size) {
+    if (todo_doc.num_patches > 1) {
+        qsort(todo_doc.patches, todo_doc.num_patches, sizeof(size_t), compare_size);
+    }
+    uint32_t count = 0;
+    size_t pos = 0;
+    size_t added = 0;
+    int patch = 0;
+
+    for (int i = 0; i < todo_doc.num_lines; i++) {
+        const struct todo_line *line = &todo_doc.lines[i];
+        if (line->kind == LINE_DELETED) {
+            continue;
+        }
+        if (line->offset >= todo_doc.size) {
+            added += line->length;
+            continue;
+        }
+        if (line->offset > pos) {
+            char *bytes = add_undo_hunk(entry, size, pos, line->offset - pos, 0);
+            copy_loaded_bytes(bytes, pos, line->offset, &patch);
+            count++;
+        }
+        for (; patch < todo_doc.num_patches && todo_doc.patches[patch] < line->offset + line->length;
+             patch++) {
+            char *bytes = add_undo_hunk(entry, size, todo_doc.patches[patch], 1, 1);
+            bytes[0] = ' ';
+            bytes[1] = 'x';
+            count++;
+        }
+        pos = line->offset + line->length;
+    }
+
+    // Lines removed from the end of the file, and the ones added after them
+    if (pos < todo_doc.size || added > 0) {
+        char *bytes = add_undo_hunk(entry, size, pos, todo_doc.size - pos, added);
+        copy_loaded_bytes(bytes, pos, todo_doc.size, &patch);
+        bytes += todo_doc.size - pos;
+        for (int i = 0; i < todo_doc.num_lines; i++) {
+            const struct todo_line *line = &todo_doc.lines[i];
+            if (line->kind != LINE_DELETED && line->offset >= todo_doc.size) {
+                memcpy(bytes, line_data(&todo_doc, line), line->length);
+                bytes += line->length;
+            }
+        }
+        count++;
+    }
+    return count;
+}
+
+static int read_undo_header(FILE *file, struct undo_header *header) {
+    return file && fseek(file, 0, SEEK_SET) == 0 && fread(header, sizeof(*header), 1, file) == 1 &&
+           memcmp(header->magic, UNDO_MAGIC, 8) == 0 && header->count >= 0 &&
+           header->count <= UNDO_DEPTH && header->position >= 0 &&
+           header->position <= header->count;
+}
+
+static int write_undo_header(FILE *file, const struct undo_header *header) {
+    return fseek(file, 0, SEEK_SET) == 0 && fwrite(header, sizeof(*header), 1, file) == 1 &&
+           fflush(file) == 0;
+}
+
+/**
+ * Add an entry to the undo log for a save from the file before to the file
+ * after, dropping the entries that were undone and, once there are
+ * UNDO_DEPTH of them, the oldest one. If the log was left at another file
+ * than before, it starts over with the entry. The header is invalidated
+ * while the log is rewritten, like the index.
+ */
+static void push_undo_entry(const char *entry, size_t size, const struct file_identity *before,
+                            const struct file_identity *after) {
+    char *path = sidecar_path(todos_filename, ".undo");
+    FILE *file = fopen(path, "r+b");
+    if (!file) {
+        file = fopen(path, "w+b");
+    }
+    free(path);
+    if (!file) {
+        return;
+    }
+
+    struct undo_header header;
+    if (!read_undo_header(file, &header) || memcmp(&header.file, before, sizeof(*before)) != 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, UNDO_MAGIC, 8);
+        header.offsets[0] = sizeof(header);
+    }
+    header.count = header.position;
+    header.file = *after;
+
+    struct undo_header invalid = header;
+    memset(invalid.magic, 0, 8);
+    int ok = write_undo_header(file, &invalid);
+
+    if (ok && header.count == UNDO_DEPTH) {
+        // Move the rest of the entries over the oldest one
+        size_t dropped = header.offsets[1] - header.offsets[0];
+        size_t kept = header.offsets[header.count] - header.offsets[1];
+        char *rest = todo_malloc(kept > 0 ? kept : 1);
+        ok = fseek(file, (long)header.offsets[1], SEEK_SET) == 0 &&
+             fread(rest, 1, kept, file) == kept &&
+             fseek(file, (long)header.offsets[0], SEEK_SET) == 0 &&
+             fwrite(rest, 1, kept, file) == kept;
+        free(rest);
+        for (int i = 0; i < header.count; i++) {
+            header.offsets[i] = header.offsets[i + 1] - dropped;
+        }
+        header.count--;
+    }
+
+    uint64_t at = header.offsets[header.count];
+    ok = ok && fseek(file, (long)at, SEEK_SET) == 0 && fwrite(entry, 1, size, file) == size;
+    if (ok) {
+        header.count++;
+        header.position = header.count;
+        header.offsets[header.count] = at + size;
+        ok = write_undo_header(file, &header);
+    }
+#ifndef _WIN32
+    // What's past the last entry is never read, it would only waste space
+    ok = ok && ftruncate(fileno(file), (off_t)(at + size)) == 0;
+#endif
+    fclose(file);
+}
+
+/**
+ * Record the unsaved changes to todo_doc as an undo entry, before it's saved.
+ *
+ * @return The entry, to be passed to push_undo() once the save succeeded, or
+ *         NULL if nothing changed.
+ */
+static char *collect_undo(size_t *size) {
+    char *entry = todo_malloc(sizeof(struct undo_entry));
+    *size = sizeof(struct undo_entry);
+    struct undo_entry header = { 0 };
+    header.size_before = todo_doc.identity.size;
+    header.hash_before = todo_doc.identity.hash;
+    header.num_hunks = collect_undo_hunks(&entry, size);
+    if (header.num_hunks == 0) {
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry, &header, sizeof(header));
+    return entry;
+}
+
+/** Fill in the identity of the saved file and add entry to the undo log. */
+static void push_undo(char *entry, size_t size) {
+    struct todo_doc saved;
+    map_todo_file(&saved, todos_filename);
+    struct undo_entry header;
+    memcpy(&header, entry, sizeof(header));
+    header.size_after = saved.identity.size;
+    header.hash_after = saved.identity.hash;
+    memcpy(entry, &header, sizeof(header));
+    push_undo_entry(entry, size, &todo_doc.identity, &saved.identity);
+    free_todo_doc(&saved);
+}
+
+/**
+ * Return whether the hunks of an undo entry of size bytes, as read from the
+ * log, take up exactly the bytes after it.
+ */
+static int undo_hunks_fit(const struct undo_entry *entry, size_t size) {
+    size_t left = size - sizeof(*entry);
+    const char *p = (const char *)(entry + 1);
+    for (uint32_t i = 0; i < entry->num_hunks; i++) {
+        struct undo_hunk hunk;
+        if (left < sizeof(hunk)) {
+            return 0;
+        }
+        memcpy(&hunk, p, sizeof(hunk));
+        left -= sizeof(hunk);
+        if (hunk.old_length > left || hunk.new_length > left - hunk.old_length) {
+            return 0;
+        }
+        left -= hunk.old_length + hunk.new_length;
+        p += sizeof(hunk) + hunk.old_length + hunk.new_length;
+    }
+    return left == 0;
+}
+
+/**
+ * Write the file that todo_doc becomes when undoing.entry is undone or
+ * redone: the unchanged ranges copied from todo_doc, the hunks in between.
+ * Hunk offsets are into the file before the entry's save, so undoing moves
+ * them by how much the hunks before them grew or shrank the file.
+ */
+static void write_undo_hunks(struct piece_writer *writer) {
+    const char *p = (const char *)(undoing.entry + 1);
+    size_t pos = 0;
+    int64_t delta = 0;
+
+    for (uint32_t i = 0; i < undoing.entry->num_hunks && writer->ok; i++) {
+        struct undo_hunk hunk;
+        memcpy(&hunk, p, sizeof(hunk));
+        const char *old_bytes = p + sizeof(hunk);
+        const char *new_bytes = old_bytes + hunk.old_length;
+        p = new_bytes + hunk.new_length;
+
+        size_t at = undoing.redo ? hunk.offset : (size_t)((int64_t)hunk.offset + delta);
+        size_t replaced = undoing.redo ? hunk.old_length : hunk.new_length;
+        if (at < pos || at > todo_doc.size || replaced > todo_doc.size - at) {
+            writer->ok = 0;
+            break;
+        }
+        copy_piece(writer, pos, at);
+        if (undoing.redo) {
+            write_piece(writer, new_bytes, hunk.new_length);
+        } else {
+            write_piece(writer, old_bytes, hunk.old_length);
+        }
+        pos = at + replaced;
+        delta += (int64_t)hunk.new_length - (int64_t)hunk.old_length;
+    }
+    if (writer->ok) {
+        copy_piece(writer, pos, todo_doc.size);
+    }
+    flush_pieces(writer);
+}
+
+/**
+ * Undo the last save of the todo file that wasn't undone, or redo the last
+ * one that was. The file isn't parsed: it must be the file the log was left
+ * at, down to its inode and modification time, and its size and hash what
+ * the save left (or, for redo, found), else it has been changed some other
+ * way and is left alone.
+ *
+ * @param redo 0 to undo, 1 to redo.
+ */
+void undo_change(int redo) {
+    const char *verb = redo ? "redo" : "undo";
+    if (has_journal()) {
+        printf("Run compact before you %s, the journal has unsaved changes.\n", verb);
+        return;
+    }
+
+    char *path = sidecar_path(todos_filename, ".undo");
+    FILE *file = fopen(path, "r+b");
+    free(path);
+    struct undo_header header;
+    if (!read_undo_header(file, &header) ||
+        (redo ? header.position == header.count : header.position == 0)) {
+        printf("Nothing to %s.\n", verb);
+        if (file) {
+            fclose(file);
+        }
+        return;
+    }
+
+    // The entry has to lie within the log, and its hunks within the entry
+    int index = redo ? header.position : header.position - 1;
+    long log_size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    int fits = header.offsets[index] <= header.offsets[index + 1] &&
+               log_size >= 0 && header.offsets[index + 1] <= (uint64_t)log_size;
+    size_t size = fits ? header.offsets[index + 1] - header.offsets[index] : 0;
+    struct undo_entry *entry = todo_malloc(size > sizeof(*entry) ? size : sizeof(*entry));
+    if (size < sizeof(*entry) || fseek(file, (long)header.offsets[index], SEEK_SET) != 0 ||
+        fread(entry, 1, size, file) != size || !undo_hunks_fit(entry, size)) {
+        printf("The undo log of %s is damaged.\n", todos_filename);
+        free(entry);
+        fclose(file);
+        return;
+    }
+
+    map_todo_file(&todo_doc, todos_filename);
+    uint64_t expected_size = redo ? entry->size_before : entry->size_after;
+    uint64_t expected_hash = redo ? entry->hash_before : entry->hash_after;
+    if (memcmp(&todo_doc.identity, &header.file, sizeof(struct file_identity)) != 0 ||
+        todo_doc.identity.size != expected_size || todo_doc.identity.hash != expected_hash) {
+        printf("%s was changed since, can't %s.\n", todos_filename, verb);
+    } else {
+        undoing.entry = entry;
+        undoing.redo = redo;
+        if (replace_file(write_undo_hunks)) {
+            struct todo_doc written;
+            map_todo_file(&written, todos_filename);
+            header.file = written.identity;
+            free_todo_doc(&written);
+            header.position += redo ? 1 : -1;
+            write_undo_header(file, &header);
+        }
+        undoing.entry = NULL;
+    }
+
+    free_todo_doc(&todo_doc);
+    free(entry);
+    fclose(file);
+}
+
+/**
+ * The todo file was changed by someone else since todo_doc was loaded from
+ * it: make the edits to todo_doc again on current, the file as it is now,
+ * which becomes todo_doc.
+ */
+static void rebase_changes(struct todo_doc *current) {
+    struct todo_doc old = todo_doc;
+    todo_doc = *current;
+    parse_lines(&todo_doc);
+
+    // The journal already has the edits
+    int recording = journal.recording;
+    journal.recording = 0;
+    for (int i = 0; i < old.num_changes; i++) {
+        apply_change(&old.changes[i]);
+    }
+    journal.recording = recording;
+    free_todo_doc(&old);
+}
+
+/**
+ * Write todo_doc to the todo file: only what changed, by save_in_place(),
+ * unless atomic_save asks for the file to be replaced as a whole. The
+ * inverse of the changes goes to the undo log.
+ *
+ * @return 1 if successful, 0 if there was an error.
+ */
+static int save_document(void) {
+    // If we have never read or added any lines, there's nothing to save
+    if (!todo_doc.data && !todo_doc.added_size) return 1;
+
+    // Compare and swap: if the file isn't the one that was loaded any more,
+    // the edits are made again on the new one instead of overwriting it
+    for (int attempt = 0;; attempt++) {
+        struct todo_doc current;
+        map_todo_file(&current, todos_filename);
+        if (memcmp(&current.identity, &todo_doc.identity, sizeof(struct file_identity)) == 0) {
+            free_todo_doc(&current);
+            break;
+        }
+        if (attempt == SAVE_CONFLICT_RETRIES) {
+            printf("Error saving %s, it keeps being changed.\n", todos_filename);
+            free_todo_doc(&current);
+            return 0;
+        }
+        rebase_changes(&current);
+    }
+
+    // The changes are taken before saving, which may overwrite the mapping
+    size_t undo_size;
+    char *undo = collect_undo(&undo_size);
+
+#ifndef _WIN32
+    int ok = atomic_save ? replace_file(write_all_lines) : save_in_place();
+#else
+    int ok = replace_file(write_all_lines);
+#endif
+    if (ok) {
+        todo_doc.num_patches = 0;
+        todo_doc.num_changes = 0;
+        if (undo) {
+            push_undo(undo, undo_size);
+        }
+    }
+    free(undo);
+    return ok;
+}
+
+/**
+ * Fold the journal back into the todo file: save todo_doc, which it was
+ * replayed over, and delete the journal.
+ */
+void compact_journal(void) {
+    if (save_document() && journal.replayed) {
+        char *path = sidecar_path(todos_filename, ".journal");
+        remove(path);
+        free(path);
+        journal.replayed = 0;
+        journal.length = 0;
+    }
+}
+
+/**
+ * Save todo_doc to the current file (overwrite).
+ *
+ * In journal mode the edits are appended to the journal instead, until it
+ * reaches JOURNAL_COMPACT_SIZE and is compacted. Otherwise the file is saved
+ * and a journal that was replayed is folded into it.
+ */
+void save_todos(void) {
+    if (journal.recording) {
+        if (journal.size == 0) {
+            return;
+        }
+        // If the journal can't be written, save the file instead
+        size_t size = append_journal();
+        if (size > 0 && size < JOURNAL_COMPACT_SIZE) {
+            return;
+        }
+    }
+
+    compact_journal();
+}
+
+/**
+ * Comparison function for descending order of two ints.
+ * Used by qsort() when we want to process bigger indexes first.
+ */
+int compare_int_desc(const void *a, const void *b) {
+    int ai = *(const int *)a;
+    int bi = *(const int *)b;
+    // Bigger numbers come first; comparing instead of subtracting can't overflow
+    return (ai < bi) - (ai > bi);
+}
+
+/**
+ * Check or remove several unfinished tasks at once. The indexes all refer to
+ * the numbering before any of the tasks changes, and repeated indexes name
+ * the same task. They are resolved against one scan of the line table, which
+ * marks the tasks in a bitset, and then applied in a single pass over it.
+ * Invalid indexes are reported like check_todo() and remove_task() do.
+ *
+ * @param indexes The 1-based indexes of the tasks; sorted in place.
+ * @param count Number of indexes.
+ * @param kind LINE_FINISHED to check the tasks or LINE_DELETED to remove them.
+ */
+void update_tasks(int *indexes, int count, int kind) {
+    // Sort the indexes in descending order and drop the repeated ones
+    qsort(indexes, count, sizeof(int), compare_int_desc);
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || indexes[i] != indexes[unique - 1]) {
+            indexes[unique++] = indexes[i];
+        }
+    }
+
+    // Report the indexes past the last task, the highest first
+    int first = 0;
+    while (first < unique && (todo_doc.num_unfinished == 0 || indexes[first] > todo_doc.num_unfinished)) {
+        find_unfinished_task(indexes[first++]);
+    }
+    if (first == unique) {
+        return;
+    }
+
+    size_t num_words = (size_t)todo_doc.num_lines / 64 + 1;
+    uint64_t *marked = todo_malloc(num_words * sizeof(uint64_t));
+    memset(marked, 0, num_words * sizeof(uint64_t));
+
+    // Walk the table once, matching the task numbers in ascending order
+    int next = unique - 1;
+    for (int i = 0, number = 0; i < todo_doc.num_lines && next >= first; i++) {
+        if (todo_doc.lines[i].kind == LINE_UNFINISHED && ++number == indexes[next]) {
+            marked[i / 64] |= (uint64_t)1 << (i % 64);
+            next--;
+        }
+    }
+
+    for (size_t word = 0; word < num_words; word++) {
+        for (uint64_t bits = marked[word]; bits; bits &= bits - 1) {
+            update_task_line((int)(word * 64 + __builtin_ctzll(bits)), kind);
+        }
+    }
+
+    free(marked);
+}
+
+/**
+ * Check or remove the unfinished tasks given by the index arguments.
+ * 
+ * @param argc Number of arguments.
+ * @param argv Array of arguments.
+ * @param index Index of the first index argument.
+ * @param kind LINE_FINISHED to check the tasks or LINE_DELETED to remove them.
+ * @return 0 if successful, 1 if there was an error.
+ */
+int update_tasks_with_indexes(int argc, char *argv[], int index, int kind) {
+    // Collect all indexes into an array
+    int numIndexes = 0;
+    int capacity = argc - index;
+    int *indexes = todo_malloc(capacity * sizeof(int));
+
+    // Parse all remaining arguments as indexes
+    for (int i = index; i < argc; i++) {
+        int idx = atoi(argv[i]);
+        if (idx <= 0) {
+            printf("Skipping invalid index: %s\n", argv[i]);
+            continue;
+        }
+        indexes[numIndexes++] = idx;
+    }
+
+    update_tasks(indexes, numIndexes, kind);
+
+    free(indexes);
+    return 0;
+}
+
+/**
+ * Parse the --limit and --offset options of the list command at argv[index],
+ * printing the usage if they're wrong.
+ *
+ * @return 1 if successful, 0 if the options are wrong.
+ */
+static int parse_list_options(int argc, char *argv[], int index, int *offset, int *limit) {
+    for (int i = index + 1; i < argc; i += 2) {
+        char *end = NULL;
+        long value = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : -1;
+        if (value < 0 || value > INT_MAX || !end || *end != '\0') {
+            printf("Usage: %s [<file.md>] list [--limit <n>] [--offset <m>]\n", argv[0]);
+            return 0;
+        }
+        if (strcmp(argv[i], "--limit") == 0) {
+            *limit = (int)value;
+        } else if (strcmp(argv[i], "--offset") == 0) {
+            *offset = (int)value;
+        } else {
+            printf("Usage: %s [<file.md>] list [--limit <n>] [--offset <m>]\n", argv[0]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Run the command at argv[index] on todo_doc: list, check, remove, clean or,
+ * for anything else, add it as a task. The changes aren't saved. todo_doc
+ * may only be left unloaded to list a window of the tasks, which are then
+ * read lazily from the file.
+ *
+ * @param argc Number of arguments.
+ * @param argv The arguments, argv[0] being the program name for messages.
+ * @param index Where the command is in argv.
+ * @return The exit status: 0, or 1 for a command that is used wrongly.
+ */
+int run_command(int argc, char *argv[], int index) {
+    /*
+     * There are one letter shortcuts for almost every command, so l for
+     * list, c for check and so on.
+     */
+    if (strcmp(argv[index], "list") == 0 || strcmp(argv[index], "l") == 0) {
+        int offset = 0;
+        int limit = -1;
+        if (!parse_list_options(argc, argv, index, &offset, &limit)) {
+            return 1;
+        }
+
+        if (index + 1 < argc) {
+            list_todos_window(offset, limit);
+        } else {
+            list_todos();
+        }
+    }
+    else if (strcmp(argv[index], "check") == 0 || strcmp(argv[index], "c") == 0) {
+        if (index + 1 >= argc) {
+            printf("Usage: %s [<file.md>] check <index>\n", argv[0]);
+            return 1;
+        }
+
+        update_tasks_with_indexes(argc, argv, index + 1, LINE_FINISHED);
+    }
+    else if (strcmp(argv[index], "remove") == 0 || strcmp(argv[index], "r") == 0) {
+        if (index + 1 >= argc) {
+            printf("Usage: %s [<file.md>] remove <index>\n", argv[0]);
+            return 1;
+        }
+
+        update_tasks_with_indexes(argc, argv, index + 1, LINE_DELETED);
+    }
+    else if (strcmp(argv[index], "clean") == 0) {
+        remove_finished_tasks();
+    }
+    else {
+        // Assume the argument is a new task to add
+        // (If there are multiple arguments, you might want to join them)
+        add_todo(argv[index]);
+    }
+    return 0;
+}
+
+/**
+ * Run the commands of a script on todo_doc, one per line, in order, so each
+ * sees the tasks as the ones before it left them, like separate commands
+ * would. A line is a command with its arguments separated by spaces: add
+ * (or a) followed by the task, list, check, remove or clean, with the same
+ * shortcuts as on the command line. Empty lines and lines
+ * starting with # are skipped. The changes aren't saved.
+ *
+ * @param argc Number of arguments.
+ * @param argv The arguments, argv[0] being the program name for messages.
+ * @param index Where the batch command is in argv; the script file may
+ *              follow it, otherwise or for "-" the script is read from stdin.
+ * @return The exit status: 0, or that of the first command that failed, which
+ *         ends the batch.
+ */
+int run_batch(int argc, char *argv[], int index) {
+    FILE *script = stdin;
+    const char *script_name = "stdin";
+    if (index + 2 < argc) {
+        printf("Usage: %s [<file.md>] batch [<script>]\n", argv[0]);
+        return 1;
+    }
+    if (index + 1 < argc && strcmp(argv[index + 1], "-") != 0) {
+        script_name = argv[index + 1];
+        script = fopen(script_name, "r");
+        if (!script) {
+            printf("Error opening %s.\n", script_name);
+            return 1;
+        }
+    }
+
+    struct line_reader reader;
+    line_reader_open(&reader, script);
+    char *line = NULL;
+    size_t capacity = 0;
+    char **words = NULL;
+    int word_capacity = 0;
+    int status = 0;
+    for (int line_number = 1; status == 0; line_number++) {
+        size_t length;
+        const char *next = line_reader_next(&reader, &length);
+        if (!next) {
+            break;
+        }
+
+        // The line is taken apart as a string, which a NUL byte would cut
+        if (memchr(next, '\0', length)) {
+            printf("Line %d of %s has a NUL byte in it.\n", line_number, script_name);
+            printf("Stopped at line %d of %s, nothing was saved.\n", line_number, script_name);
+            status = 1;
+            break;
+        }
+        if (length + 1 > capacity) {
+            capacity = length + 1;
+            line = todo_realloc(line, capacity);
+        }
+        memcpy(line, next, length);
+        line[length] = '\0';
+
+        while (length > 0 && isspace((unsigned char)line[length - 1])) {
+            line[--length] = '\0';
+        }
+        char *command = line;
+        while (isspace((unsigned char)*command)) {
+            command++;
+        }
+        if (*command == '\0' || *command == '#') {
+            continue;
+        }
+
+        // The task to add is the rest of the line as it is
+        size_t command_length = strcspn(command, " \t");
+        if ((command_length == 3 && strncmp(command, "add", 3) == 0) ||
+            (command_length == 1 && command[0] == 'a')) {
+            char *task = command + command_length;
+            while (isspace((unsigned char)*task)) {
+                task++;
+            }
+            if (*task == '\0') {
+                printf("Usage: add <task>\n");
+                status = 1;
+            } else {
+                add_todo(task);
+            }
+        } else {
+            int num_words = 1;
+            for (char *word = strtok(command, " \t"); word; word = strtok(NULL, " \t")) {
+                if (num_words + 1 > word_capacity) {
+                    word_capacity = word_capacity ? word_capacity * 2 : 16;
+                    words = todo_realloc(words, word_capacity * sizeof(char *));
+                }
+                words[num_words++] = word;
+            }
+            words[0] = argv[0];
+            const char *known[] = { "list", "l", "check", "c", "remove", "r", "clean" };
+            int is_known = 0;
+            for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+                is_known |= strcmp(words[1], known[i]) == 0;
+            }
+            if (is_known) {
+                status = run_command(num_words, words, 1);
+            } else {
+                printf("Unknown command: %s\n", words[1]);
+                status = 1;
+            }
+        }
+        if (status != 0) {
+            printf("Stopped at line %d of %s, nothing was saved.\n", line_number, script_name);
+        }
+    }
+
+    line_reader_close(&reader);
+    free(words);
+    free(line);
+    if (script != stdin) {
+        fclose(script);
+    }
+    return status;
+}
+
+/*
+ * Several files. Given more than one file, as in `todo README.md notes.md
+ * list`, the unfinished tasks of all of them are numbered as one list, in
+ * the order of the files, and check and remove take those numbers. The files
+ * are loaded at once by a pool of threads, each loading the next file left
+ * until there are none. Everything after that works on the globals of the
+ * current file, so it runs for one file after the other, making each file
+ * the current one in turn.
+ */
+
+struct todo_file {
+    const char *filename;
+    struct todo_doc doc;
+    int lock_fd;
+};
+
+static struct {
+    struct todo_file *files;
+    int count;
+    int next;  // The next file to load
+} file_loader;
+
+/**
+ * Load the files of file_loader until there are none left; run by each
+ * thread of the pool.
+ */
+static void *load_files(void *worker) {
+    (void)worker;
+    for (;;) {
+        int i = __atomic_fetch_add(&file_loader.next, 1, __ATOMIC_RELAXED);
+        if (i >= file_loader.count) {
+            return NULL;
+        }
+        load_todo_doc(&file_loader.files[i].doc, file_loader.files[i].filename);
+    }
+}
+
+static int compare_file_names(const void *a, const void *b) {
+    return strcmp((*(const struct todo_file **)a)->filename, (*(const struct todo_file **)b)->filename);
+}
+
+/**
+ * Lock the files, shared to list them or exclusive to change them, in the
+ * order of their names so that commands on overlapping files can't wait for
+ * each other.
+ *
+ * @return 1 if all files are locked, 0 if one timed out.
+ */
+static int lock_files(struct todo_file *files, int count, int exclusive) {
+    struct todo_file **order = todo_malloc(count * sizeof(struct todo_file *));
+    for (int i = 0; i < count; i++) {
+        order[i] = &files[i];
+    }
+    qsort(order, count, sizeof(struct todo_file *), compare_file_names);
+
+    int ok = 1;
+    for (int i = 0; i < count && ok; i++) {
+        todos_filename = order[i]->filename;
+        ok = lock_todos(exclusive);
+        order[i]->lock_fd = lock_fd;
+        lock_fd = -1;
+    }
+    free(order);
+    return ok;
+}
+
+/**
+ * Run the command at argv[index] on several files: list their unfinished
+ * tasks numbered as one list, check or remove tasks by those numbers, or
+ * clean them all. Each file that changes is saved. A file given twice is only
+ * used once.
+ *
+ * @param num_files Number of files.
+ * @param filenames The files, in the order their tasks are numbered.
+ * @param argc Number of arguments.
+ * @param argv The arguments, argv[0] being the program name for messages.
+ * @param index Where the command is in argv.
+ * @return The exit status: 0, or 1 for a command that is used wrongly or
+ *         files that couldn't be locked.
+ */
+int run_files(int num_files, char *filenames[], int argc, char *argv[], int index) {
+    const char *command = argv[index];
+    int listing = strcmp(command, "list") == 0 || strcmp(command, "l") == 0;
+    int cleaning = strcmp(command, "clean") == 0;
+    int kind = LINE_OTHER;
+    if (strcmp(command, "check") == 0 || strcmp(command, "c") == 0) {
+        kind = LINE_FINISHED;
+    } else if (strcmp(command, "remove") == 0 || strcmp(command, "r") == 0) {
+        kind = LINE_DELETED;
+    }
+    if (!listing && !cleaning && kind == LINE_OTHER) {
+        printf("Only list, check, remove and clean work on several files.\n");
+        return 1;
+    }
+
+    int offset = 0;
+    int limit = -1;
+    if (listing && !parse_list_options(argc, argv, index, &offset, &limit)) {
+        return 1;
+    }
+    int num_indexes = 0;
+    int *indexes = todo_malloc((argc - index) * sizeof(int));
+    int *local = todo_malloc((argc - index) * sizeof(int));
+    if (kind != LINE_OTHER) {
+        if (index + 1 >= argc) {
+            printf("Usage: %s <file.md>... %s <index>\n", argv[0], command);
+            free(indexes);
+            free(local);
+            return 1;
+        }
+        for (int i = index + 1; i < argc; i++) {
+            int task = atoi(argv[i]);
+            if (task <= 0) {
+                printf("Skipping invalid index: %s\n", argv[i]);
+            } else {
+                indexes[num_indexes++] = task;
+            }
+        }
+    }
+
+    // The same file may be named twice, e.g. by overlapping globs
+    struct todo_file *files = todo_malloc(num_files * sizeof(struct todo_file));
+    int count = 0;
+    for (int i = 0; i < num_files; i++) {
+        int seen = 0;
+#ifndef _WIN32
+        struct stat st, other;
+        int exists = stat(filenames[i], &st) == 0;
+        for (int j = 0; j < count && !seen; j++) {
+            seen = exists && stat(files[j].filename, &other) == 0 && st.st_dev == other.st_dev &&
+                   st.st_ino == other.st_ino;
+        }
+#endif
+        for (int j = 0; j < count && !seen; j++) {
+            seen = strcmp(filenames[i], files[j].filename) == 0;
+        }
+        if (!seen) {
+            memset(&files[count], 0, sizeof(struct todo_file));
+            files[count].filename = filenames[i];
+            files[count].lock_fd = -1;
+            count++;
+        }
+    }
+
+    int status = lock_files(files, count, !listing) ? 0 : 1;
+    if (status == 0) {
+        int workers[MAX_THREADS] = { 0 };
+        file_loader.files = files;
+        file_loader.count = count;
+        file_loader.next = 0;
+        run_parallel(load_files, workers, sizeof(int), thread_count(count));
+
+        // The tasks of each file are numbered on from base
+        long long window_end = limit >= 0 ? (long long)offset + limit : LLONG_MAX;
+        int base = 0;
+        int done = 0;
+        for (int i = 0; i < count; i++) {
+            todo_doc = files[i].doc;
+            todos_filename = files[i].filename;
+            replay_journal();
+            int num_unfinished = todo_doc.num_unfinished;
+            int changed = 0;
+
+            if (listing) {
+                int first = offset > base ? offset - base : 0;
+                int end = window_end - base < num_unfinished ? (int)(window_end - base) : num_unfinished;
+                if (first < end) {
+                    printf("%s:\n", todos_filename);
+                    print_tasks(first, end, base);
+                    done = 1;
+                }
+            } else if (cleaning) {
+                changed = todo_doc.num_finished > 0;
+                if (changed) {
+                    remove_finished_tasks();
+                    done = 1;
+                }
+            } else {
+                int num_local = 0;
+                for (int j = 0; j < num_indexes; j++) {
+                    if (indexes[j] > base && indexes[j] - base <= num_unfinished) {
+                        local[num_local++] = indexes[j] - base;
+                    }
+                }
+                changed = num_local > 0;
+                if (changed) {
+                    update_tasks(local, num_local, kind);
+                }
+            }
+
+            if (changed) {
+                save_todos();
+                commit_todos();
+            }
+            files[i].doc = todo_doc;
+            base += num_unfinished;
+        }
+        memset(&todo_doc, 0, sizeof(todo_doc));
+
+        if (listing && !done && limit != 0) {
+            printf("No unfinished tasks found.\n");
+        } else if (cleaning && !done) {
+            printf("No finished tasks found.\n");
+        }
+        for (int j = 0; j < num_indexes; j++) {
+            if (base == 0) {
+                printf("No unfinished tasks found.\n");
+                break;
+            }
+            if (indexes[j] > base) {
+                printf("Invalid index: %d (only %d unfinished tasks)\n", indexes[j], base);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        free_todo_doc(&files[i].doc);
+        lock_fd = files[i].lock_fd;
+        unlock_todos();
+    }
+    free(files);
+    free(local);
+    free(indexes);
+    return status;
+}
+
+/*
+ * Server. `todo serve` keeps the document loaded and runs the commands that
+ * the CLI forwards to it over a Unix domain socket next to the file
+ * (.todo.sock for todo.md), so a command costs a round trip instead of
+ * loading and saving the file. A request is the program name and the
+ * arguments from the command on, each ending in a NUL; the answer is what
+ * the command prints, then a NUL and its exit status.
+ *
+ * Edits are saved in batches, SERVE_SAVE_DELAY_MS after the first unsaved
+ * one, and the document is loaded again after each save. A file changed by
+ * someone else is loaded again before the next command, after saving the
+ * edits still pending on it, which redoes them on the new file.
+ */
+#ifndef _WIN32
+
+static volatile sig_atomic_t serve_stopping;
+
+static void stop_serving(int signal) {
+    (void)signal;
+    serve_stopping = 1;
+}
+
+/**
+ * Fill address with the socket for todos_filename.
+ *
+ * @return 1 if successful, 0 if the path is too long for a socket.
+ */
+static int socket_address(struct sockaddr_un *address) {
+    char *path = sidecar_path(todos_filename, ".sock");
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    int ok = strlen(path) < sizeof(address->sun_path);
+    if (ok) {
+        strcpy(address->sun_path, path);
+    }
+    free(path);
+    return ok;
+}
+
+/**
+ * Write all of data to fd, retrying short writes.
+ */
+static int write_all(int fd, const void *data, size_t size) {
+    struct iovec iov = { (void *)data, size };
+    return write_buffers(fd, &iov, 1);
+}
+
+/**
+ * Read from fd until the end or max bytes, which make a request too long.
+ *
+ * @return The data, NUL-terminated, or NULL on an error.
+ */
+static char *read_all(int fd, size_t max, size_t *size) {
+    size_t capacity = 4096;
+    char *data = todo_malloc(capacity);
+    *size = 0;
+    for (;;) {
+        if (*size + 1 == capacity) {
+            if (capacity > max) {
+                free(data);
+                return NULL;
+            }
+            capacity *= 2;
+            data = todo_realloc(data, capacity);
+        }
+        ssize_t n = read(fd, data + *size, capacity - *size - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            free(data);
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        *size += (size_t)n;
+    }
+    data[*size] = '\0';
+    return data;
+}
+
+/**
+ * Run a command on the server for todos_filename, if one is running: send it
+ * argv[0] and the arguments from argv[index] on, and print its answer. The
+ * server runs commands with its own options, so a command given options is
+ * run here instead, with a note.
+ *
+ * @param status Set to the exit status of the command.
+ * @return 1 if a server ran the command, 0 if there is none.
+ */
+int forward_command(int argc, char *argv[], int index, int *status) {
+    struct sockaddr_un address;
+    struct stat st;
+    if (!socket_address(&address) || stat(address.sun_path, &st) != 0) {
+        return 0;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return 0;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        // A socket left behind by a server that is gone
+        close(fd);
+        return 0;
+    }
+    if (has_options) {
+        fprintf(stderr, "%s is being served, but not with these options; running the command here.\n",
+                todos_filename);
+        close(fd);
+        return 0;
+    }
+
+    int ok = write_all(fd, argv[0], strlen(argv[0]) + 1);
+    for (int i = index; i < argc && ok; i++) {
+        ok = write_all(fd, argv[i], strlen(argv[i]) + 1);
+    }
+    size_t size = 0;
+    char *answer = ok && shutdown(fd, SHUT_WR) == 0 ? read_all(fd, SIZE_MAX / 2, &size) : NULL;
+    close(fd);
+
+    if (!answer || size < 2 || answer[size - 2] != '\0') {
+        printf("The server for %s stopped before answering.\n", todos_filename);
+        *status = 1;
+    } else {
+        fwrite(answer, 1, size - 2, stdout);
+        *status = (unsigned char)answer[size - 1];
+    }
+    free(answer);
+    return 1;
+}
+
+/**
+ * Load todo_doc from the file, with the lock the CLI would take.
+ */
+static void serve_load(void) {
+    int locked = lock_todos(0);
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    if (locked) {
+        unlock_todos();
+    }
+}
+
+/**
+ * Save the edits to todo_doc and load it again, since saving may have
+ * moved the lines in the file.
+ *
+ * @return 1 if saved, 0 if the lock wasn't free; the edits are kept then.
+ */
+static int serve_save(void) {
+    if (!lock_todos(1)) {
+        return 0;
+    }
+    save_todos();
+    free_todo_doc(&todo_doc);
+    load_todo_doc(&todo_doc, todos_filename);
+    replay_journal();
+    unlock_todos();
+    commit_todos_if_due();
+    return 1;
+}
+
+/**
+ * Return whether the file, or its journal, looks changed since todo_doc was
+ * loaded, going by what stat() says about them.
+ */
+static int file_changed(void) {
+    struct stat st;
+    if (journal_changed()) {
+        return 1;
+    }
+    if (stat(todos_filename, &st) != 0) {
+        return todo_doc.identity.size != 0;
+    }
+    const struct file_identity *identity = &todo_doc.identity;
+    return (uint64_t)st.st_size != identity->size ||
+           (identity->size > 0 && ((uint64_t)st.st_dev != identity->device ||
+                                   (uint64_t)st.st_ino != identity->inode ||
+                                   (int64_t)st.st_mtime != identity->mtime_sec ||
+                                   (int64_t)ST_MTIME_NSEC(st) != identity->mtime_nsec));
+}
+
+/**
+ * Run a forwarded command, with stdout going to the client.
+ *
+ * @param dirty Whether todo_doc has unsaved edits; updated.
+ * @return The exit status of the command.
+ */
+static int serve_command(int argc, char *argv[], int *dirty) {
+    if (file_changed()) {
+        if (*dirty) {
+            *dirty = !serve_save();
+        } else {
+            free_todo_doc(&todo_doc);
+            serve_load();
+        }
+    }
+
+    const char *command = argv[1];
+    if (strcmp(command, "undo") == 0 || strcmp(command, "redo") == 0 || strcmp(command, "compact") == 0) {
+        // These work on the file, so it has to have all the edits first
+        if (*dirty) {
+            *dirty = !serve_save();
+        }
+        if (*dirty || !lock_todos(1)) {
+            printf("Can't lock %s, try again.\n", todos_filename);
+            return 1;
+        }
+        if (command[0] == 'c') {
+            if (has_journal()) {
+                compact_journal();
+            } else {
+                printf("No journal found.\n");
+            }
+            free_todo_doc(&todo_doc);
+        } else {
+            free_todo_doc(&todo_doc);
+            undo_change(command[0] == 'r');
+        }
+        unlock_todos();
+        serve_load();
+        return 0;
+    }
+
+    int changes = todo_doc.num_changes;
+    int status = run_command(argc, argv, 1);
+    *dirty |= todo_doc.num_changes != changes;
+    return status;
+}
+
+/**
+ * Answer a client: read its request, run it and send back the output.
+ */
+static void serve_client(int fd, int *dirty) {
+    // A client that doesn't send its request in time is dropped
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    size_t size;
+    char *request = read_all(fd, 1 << 20, &size);
+    if (!request) {
+        return;
+    }
+
+    int argc = 0;
+    char **argv = todo_malloc((size + 1) * sizeof(char *));
+    for (size_t i = 0; i < size; i += strlen(request + i) + 1) {
+        argv[argc++] = request + i;
+    }
+    argv[argc] = NULL;
+
+    int status = 1;
+    if (argc >= 2) {
+        fflush(stdout);
+        int saved_stdout = dup(STDOUT_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        status = serve_command(argc, argv, dirty);
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    char trailer[2] = { '\0', (char)status };
+    write_all(fd, trailer, sizeof(trailer));
+
+    free(argv);
+    free(request);
+}
+
+/**
+ * Serve commands on todos_filename until interrupted, see above.
+ *
+ * @return The exit status.
+ */
+int serve_todos(void) {
+    struct sockaddr_un address;
+    if (!socket_address(&address)) {
+        printf("The path of %s is too long for a socket.\n", todos_filename);
+        return 1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return 1;
+    }
+    int bound = bind(listener, (struct sockaddr *)&address, sizeof(address)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        // Take over the socket, unless its server is still running
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int running = probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        if (probe >= 0) {
+            close(probe);
+        }
+        if (running) {
+            printf("%s is already being served.\n", todos_filename);
+            close(listener);
+            return 1;
+        }
+        unlink(address.sun_path);
+        bound = bind(listener, (struct sockaddr *)&address, sizeof(address)) == 0;
+    }
+    if (!bound || listen(listener, 64) != 0) {
+        perror("bind");
+        close(listener);
+        return 1;
+    }
+
+    struct sigaction action = { 0 };
+    action.sa_handler = stop_serving;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    serve_load();
+    printf("Serving %s on %s.\n", todos_filename, address.sun_path);
+    fflush(stdout);
+
+    int dirty = 0;
+    double save_at = 0;
+    while (!serve_stopping) {
+        int timeout = -1;
+        if (dirty) {
+            double wait = (save_at - seconds_now()) * 1000;
+            timeout = wait > 0 ? (int)wait + 1 : 0;
+        }
+        if (todos_unsynced()) {
+            timeout = timeout >= 0 && timeout < sync_interval_ms ? timeout : sync_interval_ms;
+        }
+
+        struct pollfd pollfd = { .fd = listener, .events = POLLIN };
+        int ready = poll(&pollfd, 1, timeout);
+        if (ready > 0) {
+            int client = accept(listener, NULL, NULL);
+            if (client >= 0) {
+                int was_dirty = dirty;
+                serve_client(client, &dirty);
+                close(client);
+                if (dirty && !was_dirty) {
+                    save_at = seconds_now() + SERVE_SAVE_DELAY_MS / 1000.0;
+                }
+            }
+        }
+        if (dirty && seconds_now() >= save_at) {
+            dirty = !serve_save();
+            save_at = seconds_now() + SERVE_SAVE_DELAY_MS / 1000.0;
+        }
+        commit_todos_if_due();
+    }
+
+    if (dirty) {
+        serve_save();
+    }
+    commit_todos();
+    free_todo_doc(&todo_doc);
+    unlink(address.sun_path);
+    close(listener);
+    return 0;
+}
+
+#else
+
+int forward_command(int argc, char *argv[], int index, int *status) {
+    (void)argc;
+    (void)argv;
+    (void)index;
+    (void)status;
+    return 0;
+}
+
+int serve_todos(void) {
+    printf("Serving isn't supported on this platform.\n");
+    return 1;
+}
+
+#endif
+
+/*
+ * Watching. `todo watch` lists the unfinished tasks and lists them again
+ * whenever the file changes. inotify on the file's directory (so a file
+ * that an editor replaces is followed too) tells it when, and a burst of
+ * events, like an editor writing in several steps, is taken as one once the
+ * file has been quiet for WATCH_SETTLE_MS. Where there is no inotify the
+ * file is checked every WATCH_POLL_MS instead. After a change only the lines
+ * between the unchanged start and end of the file are parsed again, and the
+ * list is only printed if its tasks changed.
+ */
+
+/**
+ * Return the text of the task on a line as it's listed.
+ */
+static const char *task_text(const struct todo_doc *doc, const struct todo_line *line, size_t *length) {
+    *length = line->length - line->indent - line->text;
+    return line_data(doc, line) + line->indent + line->text;
+}
+
+/**
+ * Return whether lines [first, last) of a and [first_b, last_b) of b list
+ * the same unfinished tasks.
+ */
+static int same_tasks(const struct todo_doc *a, int first, int last, const struct todo_doc *b, int first_b,
+                      int last_b) {
+    for (;;) {
+        while (first < last && a->lines[first].kind != LINE_UNFINISHED) {
+            first++;
+        }
+        while (first_b < last_b && b->lines[first_b].kind != LINE_UNFINISHED) {
+            first_b++;
+        }
+        if (first == last || first_b == last_b) {
+            return first == last && first_b == last_b;
+        }
+        size_t length, length_b;
+        const char *text = task_text(a, &a->lines[first++], &length);
+        const char *text_b = task_text(b, &b->lines[first_b++], &length_b);
+        if (length != length_b || memcmp(text, text_b, length) != 0) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * The copy of the watched file reload_changed_lines() compares new versions
+ * with, kept up to date by patching in what changed.
+ */
+static struct {
+    char *data;
+    size_t capacity;
+} reload_copy;
+
+/**
+ * Read filename again into doc, which holds an earlier version of it (or
+ * nothing), parsing only the lines that changed: the lines before the first
+ * changed byte and after the last one keep their entries, moved by how much
+ * the file grew or shrank. The new version is mapped to compare it with a
+ * copy of the old one, which a mapping couldn't keep if the file is written
+ * in place; that copy is then patched to match, so doc's text is owned by
+ * this function and it can keep one document up to date at a time.
+ *
+ * @return Whether the unfinished tasks changed.
+ */
+int reload_changed_lines(struct todo_doc *doc, const char *filename) {
+    struct todo_doc fresh;
+    map_todo_file(&fresh, filename);
+
+    size_t common = doc->size < fresh.size ? doc->size : fresh.size;
+    size_t prefix = 0;
+    while (prefix + 4096 <= common && memcmp(doc->data + prefix, fresh.data + prefix, 4096) == 0) {
+        prefix += 4096;
+    }
+    while (prefix < common && doc->data[prefix] == fresh.data[prefix]) {
+        prefix++;
+    }
+    if (prefix == common && doc->size == fresh.size) {
+        free_todo_doc(&fresh);
+        return 0;
+    }
+    size_t suffix = 0;
+    while (suffix + 4096 <= common - prefix &&
+           memcmp(doc->data + doc->size - suffix - 4096, fresh.data + fresh.size - suffix - 4096, 4096) == 0) {
+        suffix += 4096;
+    }
+    while (suffix < common - prefix && doc->data[doc->size - 1 - suffix] == fresh.data[fresh.size - 1 - suffix]) {
+        suffix++;
+    }
+    int64_t delta = (int64_t)fresh.size - (int64_t)doc->size;
+
+    // The first line that changed; a last line without a newline that had
+    // text added to it counts too
+    int first = 0;
+    for (int step = 1 << 30; step > 0; step /= 2) {
+        if (first + step <= doc->num_lines &&
+            doc->lines[first + step - 1].offset + doc->lines[first + step - 1].length <= prefix) {
+            first += step;
+        }
+    }
+    if (first > 0 && doc->data[doc->lines[first - 1].offset + doc->lines[first - 1].length - 1] != '\n') {
+        first--;
+    }
+    // The first line after the change, which must still start a line
+    int last = doc->num_lines;
+    for (int step = 1 << 30; step > 0; step /= 2) {
+        if (last - step >= first && doc->lines[last - step].offset >= doc->size - suffix) {
+            last -= step;
+        }
+    }
+    size_t start = first < doc->num_lines ? doc->lines[first].offset : doc->size;
+    for (; last < doc->num_lines; last++) {
+        size_t offset = (size_t)(doc->lines[last].offset + delta);
+        if (offset >= start && (offset == 0 || fresh.data[offset - 1] == '\n')) {
+            break;
+        }
+    }
+    size_t old_end = last < doc->num_lines ? doc->lines[last].offset : doc->size;
+    size_t end = (size_t)(old_end + delta);
+
+    struct todo_doc part = { .data = fresh.data, .size = end };
+    index_lines(&part, start);
+    int changed = !same_tasks(doc, first, last, &part, 0, part.num_lines);
+
+    // Patch the copy: move the unchanged end, then copy in the changed lines
+    int own_copy = doc->data && doc->data == reload_copy.data;
+    if (fresh.size > reload_copy.capacity) {
+        reload_copy.capacity = fresh.size + fresh.size / 4;
+        reload_copy.data = todo_realloc(reload_copy.data, reload_copy.capacity);
+    }
+    if (own_copy) {
+        memmove(reload_copy.data + end, reload_copy.data + old_end, fresh.size - end);
+    } else if (doc->data) {
+        memcpy(reload_copy.data, doc->data, start);
+        memcpy(reload_copy.data + end, doc->data + old_end, fresh.size - end);
+    }
+    if (end > start) {
+        memcpy(reload_copy.data + start, fresh.data + start, end - start);
+    }
+
+    // The same for the line table
+    int moved = doc->num_lines - last;
+    int num_lines = first + part.num_lines + moved;
+    if (num_lines > doc->line_capacity) {
+        int capacity = num_lines + num_lines / 4;
+        doc->lines = arena_grow(&doc->arena, doc->lines, doc->num_lines * sizeof(struct todo_line),
+                                capacity * sizeof(struct todo_line));
+        doc->line_capacity = capacity;
+    }
+    for (int i = first; i < last; i++) {
+        doc->num_unfinished -= doc->lines[i].kind == LINE_UNFINISHED;
+        doc->num_finished -= doc->lines[i].kind == LINE_FINISHED;
+    }
+    memmove(doc->lines + first + part.num_lines, doc->lines + last, moved * sizeof(struct todo_line));
+    memcpy(doc->lines + first, part.lines, part.num_lines * sizeof(struct todo_line));
+    for (int i = first + part.num_lines; i < num_lines; i++) {
+        doc->lines[i].offset += delta;
+    }
+    doc->num_lines = num_lines;
+    doc->num_unfinished += part.num_unfinished;
+    doc->num_finished += part.num_finished;
+    doc->unfinished_tree = NULL;
+    doc->data = reload_copy.data;
+    doc->size = fresh.size;
+
+    arena_free(&part.arena);
+    free_todo_doc(&fresh);
+    return changed;
+}
+
+#ifndef _WIN32
+
+/**
+ * List the unfinished tasks of todo_doc, on a cleared screen if it's one,
+ * else after a blank line.
+ */
+static void show_watched(int first) {
+    if (isatty(STDOUT_FILENO)) {
+        printf("\033[H\033[2J");
+    } else if (!first) {
+        printf("\n");
+    }
+    list_todos();
+    fflush(stdout);
+}
+
+/**
+ * Wait for the file to be changed, or look changed, by polling.
+ */
+static void poll_for_change(void) {
+    struct stat before, st;
+    int existed = stat(todos_filename, &before) == 0;
+    for (;;) {
+        struct timespec pause = { WATCH_POLL_MS / 1000, (WATCH_POLL_MS % 1000) * 1000000L };
+        nanosleep(&pause, NULL);
+        int exists = stat(todos_filename, &st) == 0;
+        if (exists != existed || (exists && (st.st_size != before.st_size || st.st_ino != before.st_ino ||
+                                             st.st_mtime != before.st_mtime ||
+                                             ST_MTIME_NSEC(st) != ST_MTIME_NSEC(before)))) {
+            return;
+        }
+    }
+}
+
+#ifdef __linux__
+/**
+ * Return whether the events read from inotify include one for the file.
+ */
+static int watched_event(const char *events, ssize_t size, const char *name) {
+    for (ssize_t pos = 0; pos < size;) {
+        const struct inotify_event *event = (const struct inotify_event *)(events + pos);
+        if (event->len > 0 && strcmp(event->name, name) == 0) {
+            return 1;
+        }
+        pos += sizeof(struct inotify_event) + event->len;
+    }
     return 0;
 }
+#endif
+
+/**
+ * Watch todos_filename until interrupted, see above.
+ *
+ * @return The exit status.
+ */
+int watch_todos(void) {
+    reload_changed_lines(&todo_doc, todos_filename);
+    show_watched(1);
+
+    int fd = -1;
+#ifdef __linux__
+    const char *slash = strrchr(todos_filename, '/');
+    const char *name = slash ? slash + 1 : todos_filename;
+    char *dir = todo_malloc(strlen(todos_filename) + 2);
+    if (slash) {
+        memcpy(dir, todos_filename, slash - todos_filename + 1);
+        dir[slash - todos_filename + 1] = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd >= 0 && inotify_add_watch(fd, dir, IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_TO |
+                                                  IN_MOVED_FROM) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    free(dir);
+    _Alignas(struct inotify_event) char events[16 * 1024];
+#endif
+
+    for (;;) {
+        if (fd < 0) {
+            poll_for_change();
+        }
+#ifdef __linux__
+        else {
+            // Wait for an event for the file, then for the burst to end
+            int timeout = -1;
+            int pending = 0;
+            for (;;) {
+                struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+                int ready = poll(&pollfd, 1, timeout);
+                if (ready < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ready <= 0) {
+                    break;
+                }
+                ssize_t size = read(fd, events, sizeof(events));
+                if (size > 0 && watched_event(events, size, name)) {
+                    pending = 1;
+                    timeout = WATCH_SETTLE_MS;
+                }
+            }
+            if (!pending) {
+                continue;
+            }
+        }
+#endif
+        if (reload_changed_lines(&todo_doc, todos_filename)) {
+            show_watched(0);
+        }
+    }
+}
+
+#else
+
+int watch_todos(void) {
+    printf("Watching isn't supported on this platform.\n");
+    return 1;
+}
+
+#endif
+
+/**
+ * Set the options given before the file name, the arguments from *index on
+ * that are known options, and move *index past them. "--" ends the options,
+ * so that a task starting with "--" can be added after it; an argument that
+ * isn't a known option ends them as well.
+ *
+ * @return 1 if successful, 0 if an option has an invalid value.
+ */
+int parse_options(int argc, char *argv[], int *index) {
+    for (; *index < argc; (*index)++) {
+        const char *arg = argv[*index];
+        if (strcmp(arg, "--") == 0) {
+            (*index)++;
+            break;
+        } else if (strcmp(arg, "--index") == 0) {
+            use_index = 1;
+        } else if (strcmp(arg, "--atomic") == 0) {
+            atomic_save = 1;
+        } else if (strcmp(arg, "--journal") == 0) {
+            use_journal = 1;
+        } else if (strncmp(arg, "--durability=", 13) == 0) {
+            const char *mode = arg + 13;
+            char *end = NULL;
+            if (strcmp(mode, "none") == 0) {
+                durability = DURABILITY_NONE;
+            } else if (strcmp(mode, "full") == 0) {
+                durability = DURABILITY_FULL;
+            } else if (strncmp(mode, "batch", 5) == 0 && (mode[5] == '\0' || mode[5] == ':')) {
+                durability = DURABILITY_BATCH;
+                if (mode[5] == ':') {
+                    long interval = strtol(mode + 6, &end, 10);
+                    if (interval < 0 || interval > INT_MAX || end == mode + 6 || *end != '\0') {
+                        mode = NULL;
+                    } else {
+                        sync_interval_ms = (int)interval;
+                    }
+                }
+            } else {
+                mode = NULL;
+            }
+            if (!mode) {
+                printf("Unknown durability: %s\n", arg + 13);
+                return 0;
+            }
+        } else if (strncmp(arg, "--lock-timeout=", 15) == 0) {
+            char *end = NULL;
+            long timeout = strtol(arg + 15, &end, 10);
+            if (timeout < 0 || timeout > INT_MAX || end == arg + 15 || *end != '\0') {
+                printf("Invalid lock timeout: %s\n", arg + 15);
+                return 0;
+            }
+            lock_timeout_ms = (int)timeout;
+        } else {
+            break;
+        }
+        has_options = 1;
+    }
+    return 1;
+}
 
 #ifndef TESTING
 int main(int argc, char *argv[]) {
@@ -411,18 +4112,33 @@ int main(int argc, char *argv[]) {
     }
 
     todos_filename = "todo.md";
-    todo_lines = NULL;
+
+    // Options come first
+    int argIndex = 1;
+    if (!parse_options(argc, argv, &argIndex)) {
+        print_usage(argv[0]);
+        return 1;
+    }
 
     /*
-     * Check if the first argument ends with ".md". If yes, treat it as a filename
+     * Check if the next argument ends with ".md". If yes, treat it as a filename
      * and shift our parsing index so the next argument is the command/task.
+     * More files may follow, as long as a command comes after them; the last
+     * argument ending in ".md" may be a task to add.
      */
-    int argIndex = 1;
-    size_t len = strlen(argv[1]);
-    if (len > 3 && strcmp(argv[1] + (len - 3), ".md") == 0) {
+    size_t len = argIndex < argc ? strlen(argv[argIndex]) : 0;
+    int firstFile = argIndex;
+    if (len > 3 && strcmp(argv[argIndex] + (len - 3), ".md") == 0) {
         // Use the given file as our todos_filename
-        todos_filename = argv[1];
-        argIndex = 2; // Next argument is the command/task
+        todos_filename = argv[argIndex];
+        argIndex++; // Next argument is the command/task
+    }
+    while (argIndex > firstFile && argIndex + 1 < argc) {
+        len = strlen(argv[argIndex]);
+        if (len <= 3 || strcmp(argv[argIndex] + (len - 3), ".md") != 0) {
+            break;
+        }
+        argIndex++;
     }
 
     // If we consumed the filename, but there are no more args, print usage
@@ -431,49 +4147,63 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Load lines from the selected file
-    todo_lines = get_all_lines();
-
-    /*
-     * Now parse the next argument. If it's "list", "check", "remove", or "clean",
-     * do the corresponding operation; otherwise, assume it's a new task.
-     * 
-     * There are also one letter shortcuts for almost every command, so l for list,
-     * c for check and so on.
-     */
-    if (strcmp(argv[argIndex], "list") == 0 || strcmp(argv[argIndex], "l") == 0) {
-        list_todos();
+    if (argIndex - firstFile > 1) {
+        return run_files(argIndex - firstFile, argv + firstFile, argc, argv, argIndex);
     }
-    else if (strcmp(argv[argIndex], "check") == 0 || strcmp(argv[argIndex], "c") == 0) {
-        if (argIndex + 1 >= argc) {
-            printf("Usage: %s [<file.md>] check <index>\n", argv[0]);
-            return 1;
-        }
 
-        call_fn_with_indexes(argc, argv, argIndex + 1, check_todo);
+    if (strcmp(argv[argIndex], "serve") == 0) {
+        return serve_todos();
+    }
+    if (strcmp(argv[argIndex], "watch") == 0) {
+        return watch_todos();
+    }
 
-        save_todos();
+    // A server for the file runs the command on the document it keeps loaded;
+    // a batch is run here, on the file the server saves to
+    int batch = strcmp(argv[argIndex], "batch") == 0;
+    int status;
+    if (!batch && forward_command(argc, argv, argIndex, &status)) {
+        return status;
     }
-    else if (strcmp(argv[argIndex], "remove") == 0 || strcmp(argv[argIndex], "r") == 0) {
-        if (argIndex + 1 >= argc) {
-            printf("Usage: %s [<file.md>] remove <index>\n", argv[0]);
-            return 1;
-        }
 
-        call_fn_with_indexes(argc, argv, argIndex + 1, remove_task);
+    // Listing only reads the file, every other command changes it
+    int listing = strcmp(argv[argIndex], "list") == 0 || strcmp(argv[argIndex], "l") == 0;
+    if (!lock_todos(!listing)) {
+        return 1;
+    }
 
-        save_todos();
+    // Undo and redo work on the file as it is, without parsing it
+    if (strcmp(argv[argIndex], "undo") == 0 || strcmp(argv[argIndex], "redo") == 0) {
+        undo_change(argv[argIndex][0] == 'r');
+        commit_todos();
+        return 0;
     }
-    else if (strcmp(argv[argIndex], "clean") == 0) {
-        remove_finished_tasks();
-        save_todos();
+
+    // The lazy scan beats loading the document to list some of the tasks,
+    // unless it's indexed or there is a journal to replay over it
+    if (!listing || use_index || argIndex + 1 == argc || has_journal()) {
+        load_todo_doc(&todo_doc, todos_filename);
+        replay_journal();
     }
-    else {
-        // Assume the argument is a new task to add
-        // (If there are multiple arguments, you might want to join them)
-        add_todo(argv[argIndex]);
+
+    if (strcmp(argv[argIndex], "compact") == 0) {
+        if (!has_journal()) {
+            printf("No journal found.\n");
+            return 0;
+        }
+        compact_journal();
+    } else {
+        status = batch ? run_batch(argc, argv, argIndex) : run_command(argc, argv, argIndex);
+        if (status != 0) {
+            return status;
+        }
+        if (!listing) {
+            save_todos();
+        }
     }
 
+    // With DURABILITY_BATCH, everything a command saved is synced at once
+    commit_todos();
     return 0;
 }
 #endif
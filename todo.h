@@ -4,19 +4,278 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // Constants
-#define MAX_LINE_LENGTH 256
+
+/**
+ * Size of the blocks an arena allocates at a time.
+ */
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+/**
+ * Size of the blocks the streaming line reader reads at a time.
+ */
+#define READ_BLOCK_SIZE (256 * 1024)
+
+/**
+ * Documents are parsed in parallel in chunks of at least this size.
+ */
+#define PARALLEL_PARSE_CHUNK_SIZE (4 * 1024 * 1024)
+
+/**
+ * Upper limit for the number of threads working on one job.
+ */
+#define MAX_THREADS 16
+
+/**
+ * Number of pieces a save hands to one writev(); at most IOV_MAX.
+ */
+#define SAVE_BATCH_SIZE 1024
+
+/**
+ * Size of the buffer an in-place save copies the lines of a mapped file
+ * through, so that no write reads from pages it is changing itself.
+ */
+#define SAVE_BOUNCE_SIZE (64 * 1024)
+
+/**
+ * Unchanged ranges of a file of at least this size are copied in the kernel
+ * when saving instead of being written from memory.
+ */
+#define COPY_RANGE_MIN (64 * 1024)
+
+/**
+ * A journal is folded back into its file once it grows to this size.
+ */
+#define JOURNAL_COMPACT_SIZE (64 * 1024)
+
+/**
+ * Number of saves the undo log keeps, i.e. how many can be undone.
+ */
+#define UNDO_DEPTH 16
+
+/**
+ * How often a save loads the file again and redoes its edits on it when
+ * someone else keeps changing the file, before it gives up.
+ */
+#define SAVE_CONFLICT_RETRIES 8
+
+/**
+ * How long `todo serve` collects edits before saving them.
+ */
+#define SERVE_SAVE_DELAY_MS 20
+
+/**
+ * `todo watch` waits until the file has been quiet this long before it
+ * reads it again, and without inotify checks it this often.
+ */
+#define WATCH_SETTLE_MS 50
+#define WATCH_POLL_MS 1000
+
+// Types
+
+struct arena_block;
+
+/**
+ * A bump allocator. Everything allocated from an arena is released at once
+ * by arena_free().
+ */
+struct arena {
+    struct arena_block *blocks;
+    char *top;   // Start of the most recent allocation
+    char *next;  // Where the next allocation goes
+    char *end;   // End of the current block
+};
+
+/**
+ * What a line holds: an unfinished task ("- [ ]"), a finished task ("- [x]"),
+ * anything else, or nothing because it was removed.
+ */
+enum line_kind {
+    LINE_OTHER,
+    LINE_UNFINISHED,
+    LINE_FINISHED,
+    LINE_DELETED
+};
+
+/**
+ * One entry of a document's line table, kept to 16 bytes so scans over the
+ * table stay in cache. The line is a view into the document buffer:
+ *
+ *   offset                 offset + indent          offset + length
+ *   |  whitespace  | - [ ] | task text ...        \n |
+ *                  marker  marker + text
+ */
+struct todo_line {
+    uint64_t offset;  // Start of the line in the document buffer
+    uint32_t length;  // Length including the newline
+    uint16_t indent;  // Whitespace before the task marker
+    uint8_t kind;     // A line_kind
+    uint8_t text;     // Start of the task text relative to the marker
+};
+
+/**
+ * What identifies a version of a file: the file it is (device and inode), its
+ * size, modification time and a hash of samples of its contents (see
+ * content_hash()).
+ */
+struct file_identity {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+};
+
+#define FULL_HASH_LANES 4
+#define FULL_HASH_BLOCK (FULL_HASH_LANES * 8)
+
+/**
+ * A hash of every byte of a file, kept by the index so that a file that has
+ * only grown can be told apart from one that was also edited. The lanes run
+ * over whole blocks of FULL_HASH_BLOCK bytes and the bytes after the last
+ * whole block are kept as they are, so the hash can be carried on over an
+ * appended tail without reading the old part again.
+ */
+struct full_hash {
+    uint64_t lanes[FULL_HASH_LANES];
+    char tail[FULL_HASH_BLOCK];
+};
+
+/**
+ * An edit to a todo_doc that wasn't saved yet, kept so that it can be made
+ * again on a newer version of the file: check ('c') or remove ('r') the task
+ * on a line with the given text, remove all finished tasks ('x') or add ('a')
+ * a task with the given text.
+ */
+struct doc_change {
+    char op;
+    int line;          // Where the line was, as a hint where to look for it
+    const char *text;  // The line without its newline, or the added task
+    size_t length;
+    size_t task;       // Where the task text starts in a line
+};
+
+/**
+ * A todo file loaded into memory. The file is mapped (or read in one go where
+ * mapping isn't possible) and lines are views into that buffer, so no task
+ * text is ever copied. The line table is built in one pass when loading and
+ * every command works from it; removed lines stay in the table as
+ * LINE_DELETED until the document is saved.
+ *
+ * The line table is a piece table: text added after loading goes into a
+ * separate add buffer, and line offsets from size on refer to that buffer,
+ * so a line is a piece of either one. See line_data().
+ */
+struct todo_doc {
+    char *data;
+    size_t size;
+    int mapped;
+    struct todo_line *lines;
+    int num_lines;
+    int line_capacity;
+    int num_unfinished;
+    int num_finished;
+    int num_deleted;    // Lines removed since loading, marked or dropped
+    int first_deleted;  // The first removed line, if num_deleted > 0
+    int *unfinished_tree;  // Fenwick tree numbering the unfinished tasks
+    char *added;  // The add buffer, at offsets from size on
+    size_t added_size;
+    size_t added_capacity;
+    size_t *patches;  // Offsets of the bytes changed in data, if any
+    int num_patches;
+    int patch_capacity;
+    struct doc_change *changes;  // The edits since loading, in order
+    int num_changes;
+    int change_capacity;
+
+    struct file_identity identity;  // Of the file as loaded
+    struct arena arena;  // Owns the tables and, if not mapped, the data
+};
+
+/**
+ * A block-buffered reader that hands out whole lines of any length from a
+ * stream. Lines are returned in place in the buffer, so a line is only valid
+ * until the next call to line_reader_next().
+ */
+struct line_reader {
+    FILE *file;
+    char *buffer;
+    size_t capacity;
+    size_t start;  // First byte of the line being assembled
+    size_t scan;   // First byte not yet searched for a newline
+    size_t end;    // End of the buffered data
+    int eof;
+};
 
 // Global variables
 
+/**
+ * Number of heap allocations made through todo_malloc() and todo_realloc().
+ * The parse and load workers allocate too, so it's updated atomically.
+ */
+extern size_t todo_alloc_count;
+
+/**
+ * Number of threads used to parse large documents; 0 uses one per CPU.
+ */
+extern int parse_threads;
+
+/**
+ * Whether to keep a sidecar index (.todo.idx next to todo.md) with the line
+ * tables, so that a file that hasn't changed isn't parsed again.
+ */
+extern int use_index;
+
+/**
+ * Whether saving replaces the whole file atomically (see save_atomic()),
+ * instead of rewriting only what changed in place.
+ */
+extern int atomic_save;
+
+/**
+ * Whether edits are appended to a journal (.todo.journal next to todo.md)
+ * instead of being saved to the file.
+ */
+extern int use_journal;
+
+/**
+ * How saves are synced to disk, see commit_todos().
+ */
+enum durability {
+    DURABILITY_NONE,   // Never; the system writes them back eventually
+    DURABILITY_BATCH,  // Once per command, or every sync_interval_ms
+    DURABILITY_FULL    // After every save
+};
+extern int durability;
+extern int sync_interval_ms;
+
+/**
+ * How long a command waits for the lock on the file, see lock_todos().
+ */
+extern int lock_timeout_ms;
+
+/**
+ * Whether options were given to this command; see forward_command().
+ */
+extern int has_options;
+
 /**
  * Global pointer to the filename in use (defaults to "todo.md").
  */
 extern const char *todos_filename;
 
 /**
- * Global pointer holding all lines from the TODO file.
+ * Global document holding the loaded TODO file.
+ */
+extern struct todo_doc todo_doc;
+
+/**
+ * Global pointer holding all lines from the TODO file as strings. Only used by
+ * the get_all_lines() compatibility interface.
  */
 extern char **todo_lines;
 
@@ -24,11 +283,40 @@ extern char **todo_lines;
 
 void print_usage(const char *prog_name);
 char *skip_leading_whitespace(char *str);
+void *todo_malloc(size_t size);
+void *todo_realloc(void *ptr, size_t size);
+char *sidecar_path(const char *filename, const char *extension);
+uint64_t content_hash(const char *data, size_t size);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_grow(struct arena *arena, void *ptr, size_t old_size, size_t new_size);
+void arena_free(struct arena *arena);
 
 // File operations
 
+void line_reader_open(struct line_reader *reader, FILE *file);
+const char *line_reader_next(struct line_reader *reader, size_t *length_out);
+void line_reader_close(struct line_reader *reader);
+int load_todo_doc(struct todo_doc *doc, const char *filename);
+void free_todo_doc(struct todo_doc *doc);
+int find_unfinished_line(struct todo_doc *doc, int index);
+void set_line_kind(struct todo_doc *doc, int line_index, int kind);
+char *line_data(const struct todo_doc *doc, const struct todo_line *line);
+void append_doc_line(struct todo_doc *doc, const char *text, size_t length);
+int read_index(struct todo_doc *doc, const char *filename);
+void write_index(const struct todo_doc *doc, const char *filename);
+void append_index(const struct todo_doc *doc, const char *filename, int first, const struct full_hash *hash);
 char **get_all_lines(void);
+void free_all_lines(void);
 void save_todos(void);
+int has_journal(void);
+int journal_changed(void);
+int replay_journal(void);
+void compact_journal(void);
+void commit_todos(void);
+int todos_unsynced(void);
+void commit_todos_if_due(void);
+int lock_todos(int exclusive);
+void unlock_todos(void);
 
 // Task operations
 
@@ -39,9 +327,20 @@ void remove_finished_tasks(void);
 void remove_task(int index);
 void check_todo(int index);
 void list_todos(void);
+void list_todos_window(int offset, int limit);
 void add_todo(const char *task);
+void undo_change(int redo);
+int run_command(int argc, char *argv[], int index);
+int run_batch(int argc, char *argv[], int index);
+int run_files(int num_files, char *filenames[], int argc, char *argv[], int index);
+int forward_command(int argc, char *argv[], int index, int *status);
+int parse_options(int argc, char *argv[], int *index);
+int serve_todos(void);
+int reload_changed_lines(struct todo_doc *doc, const char *filename);
+int watch_todos(void);
 
 // Helper functions
 
-int call_fn_with_indexes(int argc, char *argv[], int index, void (*fn)(int));
+void update_tasks(int *indexes, int count, int kind);
+int update_tasks_with_indexes(int argc, char *argv[], int index, int kind);
 int compare_int_desc(const void *a, const void *b);